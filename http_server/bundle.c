@@ -0,0 +1,209 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bundle.h"
+#include "util.h"
+
+uint64_t bundle_hash(const char *data, size_t len) {
+    return fnv1a(FNV1A_INIT, data, len);
+}
+
+// Returns 1 if [off, off + len) lies inside a region of 'size' bytes
+static int in_bounds(uint64_t off, uint64_t len, uint64_t size) {
+    return off <= size && len <= size - off;
+}
+
+// Returns 1 if the stored header block ends with the blank line the extra-header splice cuts in front of
+static int is_header_block(const char *strings, uint32_t off, uint32_t len) {
+    return len >= 4 && memcmp(strings + off + len - 4, "\r\n\r\n", 4) == 0;
+}
+
+// Check every offset in the mapped bundle so lookups and writes never leave the mapping
+// Returns 0 if the bundle is well formed or -1 otherwise
+static int validate(const bundle_t *bundle) {
+    const bundle_header_t *h = bundle->header;
+    if(bundle->size < sizeof(*h) || memcmp(h->magic, BUNDLE_MAGIC, sizeof(h->magic)) != 0 || h->version != BUNDLE_VERSION){
+        return -1;
+    }
+    if(h->file_size != bundle->size || h->n_slots == 0 || (h->n_slots & (h->n_slots - 1)) != 0 || h->n_slots <= h->n_entries){
+        return -1;
+    }
+    if(!in_bounds(h->entries_off, (uint64_t) h->n_entries * sizeof(bundle_entry_t), bundle->size)
+        || !in_bounds(h->slots_off, (uint64_t) h->n_slots * sizeof(uint32_t), bundle->size)
+        || !in_bounds(h->strings_off, h->strings_len, bundle->size)
+        || h->entries_off % sizeof(uint64_t) != 0 || h->slots_off % sizeof(uint32_t) != 0){
+        return -1;
+    }
+
+    const bundle_entry_t *entries = (const bundle_entry_t *) ((const char *) bundle->base + h->entries_off);
+    const char *strings = (const char *) bundle->base + h->strings_off;
+    for(uint32_t i=0; i<h->n_entries; i++){
+        const bundle_entry_t *e = &entries[i];
+        if(!in_bounds(e->path_off, e->path_len, h->strings_len)
+            || !in_bounds(e->header_off, e->header_len, h->strings_len)
+            || !in_bounds(e->gz_header_off, e->gz_header_len, h->strings_len)
+            || !in_bounds(e->body_off, e->body_len, bundle->size)
+            || !in_bounds(e->gz_body_off, e->gz_body_len, bundle->size)){
+            return -1;
+        }
+        if(!is_header_block(strings, e->header_off, e->header_len)
+            || (e->gz_body_len > 0 && !is_header_block(strings, e->gz_header_off, e->gz_header_len))){
+            return -1;
+        }
+    }
+    const uint32_t *slots = (const uint32_t *) ((const char *) bundle->base + h->slots_off);
+    for(uint32_t i=0; i<h->n_slots; i++){
+        if(slots[i] > h->n_entries){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+bundle_t *bundle_open(const char *path) {
+    struct stat st;
+    bundle_t *bundle = calloc(1, sizeof(bundle_t));
+    if(bundle == NULL){
+        perror("calloc");
+        return NULL;
+    }
+
+    if((bundle->fd = open(path, O_RDONLY)) == -1){
+        perror("open");
+        free(bundle);
+        return NULL;
+    }
+    if(fstat(bundle->fd,&st) == -1){
+        perror("fstat");
+        close(bundle->fd);
+        free(bundle);
+        return NULL;
+    }
+    bundle->size = st.st_size;
+    if(bundle->size < sizeof(bundle_header_t)){
+        fprintf(stderr, "%s: not a bundle file\n", path);
+        close(bundle->fd);
+        free(bundle);
+        return NULL;
+    }
+    if((bundle->base = mmap(NULL, bundle->size, PROT_READ, MAP_SHARED, bundle->fd, 0)) == MAP_FAILED){
+        perror("mmap");
+        close(bundle->fd);
+        free(bundle);
+        return NULL;
+    }
+
+    bundle->header = bundle->base;
+    if(validate(bundle) == -1){
+        fprintf(stderr, "%s: corrupt or incompatible bundle file\n", path);
+        bundle_close(bundle);
+        return NULL;
+    }
+    bundle->entries = (const bundle_entry_t *) ((const char *) bundle->base + bundle->header->entries_off);
+    bundle->slots = (const uint32_t *) ((const char *) bundle->base + bundle->header->slots_off);
+    bundle->strings = (const char *) bundle->base + bundle->header->strings_off;
+    bundle->refs = 1;   // The store's own reference
+    return bundle;
+}
+
+void bundle_close(bundle_t *bundle) {
+    if(munmap(bundle->base, bundle->size) == -1){
+        perror("munmap");
+    }
+    if(close(bundle->fd) == -1){
+        perror("close");
+    }
+    free(bundle);
+}
+
+const bundle_entry_t *bundle_lookup(const bundle_t *bundle, const char *resource_name) {
+    size_t len = strlen(resource_name);
+    uint64_t h = bundle_hash(resource_name, len);
+    uint32_t mask = bundle->header->n_slots - 1;
+
+    for(uint32_t i=0; i<=mask; i++){    // Linear probing, an empty slot ends the search
+        uint32_t slot = bundle->slots[(h + i) & mask];
+        if(slot == 0){
+            return NULL;
+        }
+        const bundle_entry_t *e = &bundle->entries[slot - 1];
+        if(e->path_hash == h && e->path_len == len && memcmp(bundle->strings + e->path_off, resource_name, len) == 0){
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void bundle_prefetch(const bundle_t *bundle, const bundle_entry_t *entry) {
+    if(entry->body_len == 0){
+        return;
+    }
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);  // May be larger than the BUNDLE_PAGE_SIZE the packer aligned to
+    uint64_t start = entry->body_off & ~(page - 1);
+    if(madvise((char *) bundle->base + start, entry->body_off - start + entry->body_len, MADV_WILLNEED) == -1){
+        perror("madvise");
+    }
+}
+
+int bundle_store_init(bundle_store_t *store, const char *path) {
+    int result;
+    if((store->current = bundle_open(path)) == NULL){
+        return -1;
+    }
+    if((result = pthread_mutex_init(&store->lock,NULL)) != 0){
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(result));
+        bundle_close(store->current);
+        return -1;
+    }
+    return 0;
+}
+
+bundle_t *bundle_acquire(bundle_store_t *store) {
+    bundle_t *bundle;
+    pthread_mutex_lock(&store->lock);
+    bundle = store->current;
+    bundle->refs++;
+    pthread_mutex_unlock(&store->lock);
+    return bundle;
+}
+
+void bundle_release(bundle_store_t *store, bundle_t *bundle) {
+    int last;
+    pthread_mutex_lock(&store->lock);
+    last = (--bundle->refs == 0);
+    pthread_mutex_unlock(&store->lock);
+    if(last){   // Swapped out and no request is using it any more
+        bundle_close(bundle);
+    }
+}
+
+int bundle_store_swap(bundle_store_t *store, const char *path) {
+    bundle_t *next = bundle_open(path);
+    bundle_t *old;
+    if(next == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    old = store->current;
+    store->current = next;
+    pthread_mutex_unlock(&store->lock);
+
+    bundle_release(store, old); // Drop the store's reference, in-flight requests keep theirs
+    return 0;
+}
+
+int bundle_store_free(bundle_store_t *store) {
+    int result;
+    bundle_release(store, store->current);
+    store->current = NULL;
+    if((result = pthread_mutex_destroy(&store->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(result));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,130 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUNDLE_MAGIC "HTBUNDL1"
+#define BUNDLE_VERSION 1
+#define BUNDLE_PAGE_SIZE 4096
+
+/*
+ * On-disk layout of a content bundle built by bundle_pack. All integers are
+ * little-endian and every offset is from the start of the file.
+ *   bundle_header_t
+ *   bundle_entry_t[n_entries]
+ *   uint32_t slots[n_slots]    hash index, entry index + 1 or 0 when empty
+ *   bodies                     each one starting on a BUNDLE_PAGE_SIZE boundary
+ *   string table               paths and precomputed response headers
+ * The string table comes last so the packer can stream bodies in before it
+ * knows their hashes and compressed sizes.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t n_slots;       // Power of two, probed linearly
+    uint32_t reserved;
+    uint64_t entries_off;
+    uint64_t slots_off;
+    uint64_t strings_off;
+    uint64_t strings_len;
+    uint64_t file_size;
+} bundle_header_t;
+
+// One served resource. The gzip fields are all zero when no variant was packed.
+typedef struct {
+    uint64_t path_hash;
+    uint32_t path_off;      // Offsets into the string table
+    uint32_t path_len;
+    uint32_t header_off;
+    uint32_t header_len;
+    uint32_t gz_header_off;
+    uint32_t gz_header_len;
+    uint64_t body_off;      // Offsets into the file
+    uint64_t body_len;
+    uint64_t gz_body_off;
+    uint64_t gz_body_len;
+    uint64_t etag;
+} bundle_entry_t;
+
+// A bundle file mapped into memory
+typedef struct {
+    int fd;
+    void *base;
+    size_t size;
+    const bundle_header_t *header;
+    const bundle_entry_t *entries;
+    const uint32_t *slots;
+    const char *strings;
+    int refs;               // Protected by the owning store's lock
+} bundle_t;
+
+// Holds the bundle currently being served and lets it be replaced at runtime
+typedef struct {
+    pthread_mutex_t lock;
+    bundle_t *current;
+} bundle_store_t;
+
+/*
+ * Hash a resource path the way the bundle index does (64-bit FNV-1a)
+ */
+uint64_t bundle_hash(const char *data, size_t len);
+
+/*
+ * Map a bundle file and check that every offset in it is in bounds
+ * path: The bundle file to open
+ * Returns the opened bundle on success or NULL on error
+ */
+bundle_t *bundle_open(const char *path);
+
+/*
+ * Unmap a bundle and free it
+ */
+void bundle_close(bundle_t *bundle);
+
+/*
+ * Find the entry serving a resource name such as "/quote.txt"
+ * Returns the entry or NULL if the bundle does not contain the path
+ */
+const bundle_entry_t *bundle_lookup(const bundle_t *bundle, const char *resource_name);
+
+/*
+ * Ask the kernel to start reading an entry's body pages in ahead of use
+ */
+void bundle_prefetch(const bundle_t *bundle, const bundle_entry_t *entry);
+
+/*
+ * Initialize a store serving the bundle at 'path'
+ * Returns 0 on success or -1 on error
+ */
+int bundle_store_init(bundle_store_t *store, const char *path);
+
+/*
+ * Take a reference on the bundle currently being served. It stays mapped until
+ * the matching bundle_release(), even if the store is swapped meanwhile.
+ * Returns the current bundle
+ */
+bundle_t *bundle_acquire(bundle_store_t *store);
+
+/*
+ * Drop a reference taken with bundle_acquire()
+ */
+void bundle_release(bundle_store_t *store, bundle_t *bundle);
+
+/*
+ * Open the bundle at 'path' and atomically make it the one being served.
+ * Requests already holding the old bundle finish with it before it is unmapped.
+ * If the new bundle cannot be opened the old one stays in place.
+ * Returns 0 on success or -1 on error
+ */
+int bundle_store_swap(bundle_store_t *store, const char *path);
+
+/*
+ * Deallocates and cleans up any resources associated with a bundle store.
+ * Returns 0 on success or -1 on error
+ */
+int bundle_store_free(bundle_store_t *store);
+
+#endif // BUNDLE_H
@@ -0,0 +1,379 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bundle.h"
+#include "http.h"
+#include "util.h"
+
+#define MAX_PATH_LEN 1024
+#define MAX_HEADER_LEN 512
+#define COPY_CHUNK (1024 * 1024)    // Only this much of a body is in memory at a time
+
+// A file collected from the directory being packed. Bodies are never held in
+// memory whole: they are streamed into the bundle one chunk at a time.
+typedef struct {
+    char *path;                 // Resource name as requested, e.g. "/quote.txt"
+    char *full_path;            // Where the file is read from
+    const char *mime;
+    uint64_t size;
+} pack_file_t;
+
+static pack_file_t *files = NULL;
+static int n_files = 0;
+static int cap_files = 0;
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+// Add every servable file below 'dir' to the files array, recursing into subdirectories.
+// Only the paths and sizes are recorded here.
+// Returns 0 on success or -1 on error
+static int collect(const char *dir, const char *prefix) {
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    if(d == NULL){
+        perror("opendir");
+        return -1;
+    }
+
+    while((ent = readdir(d)) != NULL){
+        char full[MAX_PATH_LEN];
+        char rel[MAX_PATH_LEN];
+        struct stat st;
+        if(strcmp(ent->d_name,".") == 0 || strcmp(ent->d_name,"..") == 0){
+            continue;
+        }
+        if(snprintf(full, sizeof(full), "%s/%s", dir, ent->d_name) >= sizeof(full)
+            || snprintf(rel, sizeof(rel), "%s/%s", prefix, ent->d_name) >= sizeof(rel)){
+            fprintf(stderr, "Path too long, skipping %s\n", ent->d_name);
+            continue;
+        }
+        if(stat(full,&st) == -1){
+            perror("stat");
+            closedir(d);
+            return -1;
+        }
+        if(S_ISDIR(st.st_mode)){
+            if(collect(full, rel) == -1){
+                closedir(d);
+                return -1;
+            }
+            continue;
+        }
+        if(!S_ISREG(st.st_mode)){
+            continue;
+        }
+
+        const char *mime = get_mime_type_for_path(rel);
+        if(mime == NULL){   // The server would refuse it too
+            fprintf(stderr, "Unknown extension, skipping %s\n", rel);
+            continue;
+        }
+
+        if(n_files == cap_files){
+            cap_files = cap_files ? cap_files * 2 : 64;
+            pack_file_t *grown = realloc(files, cap_files * sizeof(pack_file_t));
+            if(grown == NULL){
+                perror("realloc");
+                closedir(d);
+                return -1;
+            }
+            files = grown;
+        }
+        pack_file_t *f = &files[n_files];
+        f->path = strdup(rel);
+        f->full_path = strdup(full);
+        f->mime = mime;
+        f->size = st.st_size;
+        if(f->path == NULL || f->full_path == NULL){
+            perror("strdup");
+            free(f->path);
+            free(f->full_path);
+            closedir(d);
+            return -1;
+        }
+        n_files++;
+    }
+    closedir(d);
+    return 0;
+}
+
+// Append 'len' bytes to the growing string table
+// Returns the offset they were stored at, or -1 on error
+static long strings_append(char **table, size_t *len, size_t *cap, const char *data, size_t data_len) {
+    while(*len + data_len > *cap){
+        *cap = *cap ? *cap * 2 : 4096;
+        char *grown = realloc(*table, *cap);
+        if(grown == NULL){
+            perror("realloc");
+            return -1;
+        }
+        *table = grown;
+    }
+    memcpy(*table + *len, data, data_len);
+    *len += data_len;
+    return *len - data_len;
+}
+
+// Write 'len' bytes at 'off', retrying short writes
+// Returns 0 on success or -1 on error
+static int write_at(int fd, const void *data, size_t len, uint64_t off) {
+    size_t done = 0;
+    while(done < len){
+        ssize_t n = pwrite(fd, (const char *) data + done, len - done, off + done);
+        if(n == -1){
+            perror("pwrite");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Stream one file into the bundle: the body goes to 'body_off' and, when compressing,
+// a gzip copy goes to the next page boundary after it. Both are written chunk by chunk.
+// etag: Set to the 64-bit FNV-1a hash of the body
+// gz_len: Set to the gzip copy's length, or 0 if it does not save at least 10%
+// Returns 0 on success or -1 on error
+static int pack_body(int out_fd, const pack_file_t *f, uint64_t body_off, int compress, char *in_buf, char *gz_buf,
+    uint64_t *etag, uint64_t *gz_len) {
+    uint64_t gz_off = align_up(body_off + f->size, BUNDLE_PAGE_SIZE);
+    uint64_t h = FNV1A_INIT;
+    uint64_t done = 0;
+    z_stream zs;
+    int return_val = 0;
+
+    *gz_len = 0;
+    int fd = open(f->full_path, O_RDONLY);
+    if(fd == -1){
+        perror("open");
+        return -1;
+    }
+    memset(&zs,0,sizeof(zs));
+    if(compress && deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK){   // 15 + 16 selects the gzip wrapper
+        fprintf(stderr, "deflateInit2 failed\n");
+        close(fd);
+        return -1;
+    }
+
+    while(1){
+        ssize_t n = read(fd, in_buf, COPY_CHUNK);
+        if(n == -1){
+            perror("read");
+            return_val = -1;
+            break;
+        }
+        if(done + n > f->size){ // Grew since it was collected, its slot is already laid out
+            n = f->size - done;
+        }
+        h = fnv1a(h, in_buf, n);
+        if(write_at(out_fd, in_buf, n, body_off + done) == -1){
+            return_val = -1;
+            break;
+        }
+        done += n;
+        int last = (n == 0 || done == f->size);
+
+        if(compress){   // Feed this chunk through, writing out whatever deflate produces
+            int zret;
+            zs.next_in = (Bytef *) in_buf;
+            zs.avail_in = n;
+            do{
+                zs.next_out = (Bytef *) gz_buf;
+                zs.avail_out = COPY_CHUNK;
+                zret = deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+                if(zret == Z_STREAM_ERROR){
+                    fprintf(stderr, "deflate failed\n");
+                    return_val = -1;
+                    break;
+                }
+                size_t produced = COPY_CHUNK - zs.avail_out;
+                if(write_at(out_fd, gz_buf, produced, gz_off + *gz_len) == -1){
+                    return_val = -1;
+                    break;
+                }
+                *gz_len += produced;
+            }while(zs.avail_out == 0 || (last && zret != Z_STREAM_END));
+            if(return_val == -1){
+                break;
+            }
+        }
+        if(last){
+            break;
+        }
+    }
+    if(return_val == 0 && done != f->size){
+        fprintf(stderr, "%s shrank while packing\n", f->full_path);
+        return_val = -1;
+    }
+    if(compress){
+        deflateEnd(&zs);
+        if(*gz_len * 10 >= f->size * 9){    // Not worth it, the next body overwrites it
+            *gz_len = 0;
+        }
+    }
+    close(fd);
+    *etag = h;
+    return return_val;
+}
+
+int main(int argc, char **argv) {
+    int compress = 0;
+    int argi = 1;
+    if(argc == 4 && strcmp(argv[1],"-z") == 0){
+        compress = 1;
+        argi = 2;
+    }
+    if(argc - argi != 2){
+        printf("Usage: %s [-z] <directory> <bundle file>\n", argv[0]);
+        printf("  -z  also store gzip variants of files that compress well\n");
+        return 1;
+    }
+    const char *dir = argv[argi];
+    const char *out_path = argv[argi + 1];
+
+    if(collect(dir, "") == -1){
+        return 1;
+    }
+
+    bundle_header_t header;
+    bundle_entry_t *entries = calloc(n_files > 0 ? n_files : 1, sizeof(bundle_entry_t));
+    uint32_t n_slots = 1;
+    while(n_slots < (uint32_t) n_files * 2 || n_slots <= (uint32_t) n_files){  // Keep the index at most half full
+        n_slots <<= 1;
+    }
+    uint32_t *slots = calloc(n_slots, sizeof(uint32_t));
+    char *strings = NULL;
+    size_t strings_len = 0, strings_cap = 0;
+    char *in_buf = malloc(COPY_CHUNK);
+    char *gz_buf = malloc(COPY_CHUNK);
+    if(entries == NULL || slots == NULL || in_buf == NULL || gz_buf == NULL){
+        perror("malloc");
+        return 1;
+    }
+
+    // Build next to the destination and rename over it, so a running server never maps a half-written bundle
+    char tmp_path[MAX_PATH_LEN];
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path) >= sizeof(tmp_path)){
+        fprintf(stderr, "Output path too long\n");
+        return 1;
+    }
+    int out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out_fd == -1){
+        perror("open");
+        return 1;
+    }
+
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.n_entries = n_files;
+    header.n_slots = n_slots;
+    header.entries_off = align_up(sizeof(header), sizeof(uint64_t));
+    header.slots_off = header.entries_off + (uint64_t) n_files * sizeof(bundle_entry_t);
+
+    // Bodies are streamed in one file at a time; the headers that depend on their
+    // hashes and gzip sizes go into the string table after the last body
+    int failed = 0;
+    uint64_t cursor = header.slots_off + (uint64_t) n_slots * sizeof(uint32_t);
+    for(int i=0; i<n_files && !failed; i++){
+        pack_file_t *f = &files[i];
+        bundle_entry_t *e = &entries[i];
+        char hdr[MAX_HEADER_LEN];
+        long off;
+        int hdr_len;
+
+        cursor = align_up(cursor, BUNDLE_PAGE_SIZE);
+        e->body_off = cursor;
+        e->body_len = f->size;
+        if(pack_body(out_fd, f, e->body_off, compress, in_buf, gz_buf, &e->etag, &e->gz_body_len) == -1){
+            failed = 1;
+            break;
+        }
+        cursor += f->size;
+        if(e->gz_body_len > 0){
+            e->gz_body_off = align_up(cursor, BUNDLE_PAGE_SIZE);
+            cursor = e->gz_body_off + e->gz_body_len;
+        }
+
+        e->path_len = strlen(f->path);
+        e->path_hash = bundle_hash(f->path, e->path_len);
+        if((off = strings_append(&strings, &strings_len, &strings_cap, f->path, e->path_len)) == -1){
+            return 1;
+        }
+        e->path_off = off;
+
+        hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %llu\r\nETag: \"%016llx\"\r\n%s\r\n",
+            f->mime, (unsigned long long) e->body_len, (unsigned long long) e->etag, e->gz_body_len > 0 ? "Vary: Accept-Encoding\r\n" : "");
+        if((off = strings_append(&strings, &strings_len, &strings_cap, hdr, hdr_len)) == -1){
+            return 1;
+        }
+        e->header_off = off;
+        e->header_len = hdr_len;
+
+        if(e->gz_body_len > 0){
+            hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Encoding: gzip\r\nContent-Length: %llu\r\nETag: \"%016llx-gz\"\r\nVary: Accept-Encoding\r\n\r\n",
+                f->mime, (unsigned long long) e->gz_body_len, (unsigned long long) e->etag);
+            if((off = strings_append(&strings, &strings_len, &strings_cap, hdr, hdr_len)) == -1){
+                return 1;
+            }
+            e->gz_header_off = off;
+            e->gz_header_len = hdr_len;
+        }
+
+        uint32_t slot = e->path_hash & (n_slots - 1);
+        while(slots[slot] != 0){
+            slot = (slot + 1) & (n_slots - 1);
+        }
+        slots[slot] = i + 1;
+    }
+
+    header.strings_off = cursor;
+    header.strings_len = strings_len;
+    header.file_size = cursor + strings_len;
+
+    failed = failed
+        || write_at(out_fd, strings, strings_len, header.strings_off)
+        || write_at(out_fd, entries, (size_t) n_files * sizeof(bundle_entry_t), header.entries_off)
+        || write_at(out_fd, slots, (size_t) n_slots * sizeof(uint32_t), header.slots_off)
+        || write_at(out_fd, &header, sizeof(header), 0);
+    if(!failed && ftruncate(out_fd, header.file_size) == -1){   // Drops a discarded gzip copy at the end
+        perror("ftruncate");
+        failed = 1;
+    }
+    if(!failed && fsync(out_fd) == -1){
+        perror("fsync");
+        failed = 1;
+    }
+    if(close(out_fd) == -1){
+        perror("close");
+        failed = 1;
+    }
+    if(failed || rename(tmp_path, out_path) == -1){
+        if(!failed){
+            perror("rename");
+        }
+        unlink(tmp_path);
+        return 1;
+    }
+
+    printf("Packed %d files into %s (%llu bytes)\n", n_files, out_path, (unsigned long long) header.file_size);
+    for(int i=0; i<n_files; i++){
+        free(files[i].path);
+        free(files[i].full_path);
+    }
+    free(files);
+    free(entries);
+    free(slots);
+    free(strings);
+    free(in_buf);
+    free(gz_buf);
+    return 0;
+}
@@ -0,0 +1,231 @@
+#include <errno.h>
+#include <linux/sockios.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "capture.h"
+#include "util.h"
+
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+
+// Append a record and its strings to the file. Only the drain thread writes, or
+// capture_close() once it has stopped, so the lock is not needed.
+static void write_record(capture_t *capture, const capture_record_t *record) {
+    const char *strings = (const char *) (record + 1);
+    if(fwrite(record, sizeof(*record), 1, capture->out) != 1
+        || fwrite(strings, 1, record->path_len + record->head_len, capture->out) != record->path_len + record->head_len){
+        perror("fwrite");
+        return;
+    }
+    capture->records++;
+}
+
+// Hand a finished record to the drain thread, which takes ownership. Caller holds the lock.
+static void add_pending(capture_t *capture, capture_record_t *record) {
+    if(capture->n_pending == capture->max_pending){
+        int max_pending = (capture->max_pending == 0) ? 64 : capture->max_pending * 2;
+        capture_record_t **pending = realloc(capture->pending, max_pending * sizeof(*pending));
+        if(pending == NULL){
+            perror("realloc");
+            free(record);
+            return;
+        }
+        capture->pending = pending;
+        capture->max_pending = max_pending;
+    }
+    capture->pending[capture->n_pending++] = record;
+}
+
+// Write a batch of records taken off the pending list and free them
+static void write_batch(capture_t *capture, capture_record_t **batch, int n) {
+    for(int i=0; i<n; i++){
+        write_record(capture, batch[i]);
+        free(batch[i]);
+    }
+    if(n > 0 && fflush(capture->out) != 0){
+        perror("fflush");
+    }
+}
+
+// Finish watching a draining response: work out the read rate from the bytes the
+// client acknowledged so far and queue the record. Caller holds the lock.
+static void finish_draining(capture_t *capture, int idx, uint64_t now) {
+    capture_draining_t *d = &capture->draining[idx];
+    int unacked = 0;
+    if(ioctl(d->fd, SIOCOUTQ, &unacked) == -1){ // Bytes sent but not acknowledged yet
+        unacked = 0;
+    }
+    uint64_t acked = (d->record->response_bytes > (uint32_t) unacked) ? d->record->response_bytes - unacked : 0;
+    if(now > d->started_ns){
+        uint64_t rate = acked * 1000000000ull / (now - d->started_ns);
+        d->record->read_rate = (rate > UINT32_MAX) ? UINT32_MAX : rate;
+    }
+    add_pending(capture, d->record);
+    close(d->fd);
+    capture->draining[idx] = capture->draining[--capture->n_draining];
+}
+
+// Drain thread: poll the watched sockets until the client has acknowledged everything,
+// and every tick write out the records finished since the last one
+static void *drain_thread_func(void *arg) {
+    capture_t *capture = (capture_t *) arg;
+
+    pthread_mutex_lock(&capture->lock);
+    while(!capture->stopping){
+        uint64_t now = now_ns();
+        for(int i=capture->n_draining-1; i>=0; i--){
+            int unacked = 0;
+            if(ioctl(capture->draining[i].fd, SIOCOUTQ, &unacked) == -1 || unacked <= 1   // The FIN takes one sequence number
+                || now - capture->draining[i].started_ns > CAPTURE_DRAIN_TIMEOUT_NS){
+                finish_draining(capture, i, now);
+            }
+        }
+
+        capture_record_t **batch = capture->pending;   // Take the pending records, write them without the lock
+        int n_batch = capture->n_pending;
+        capture->pending = NULL;
+        capture->n_pending = capture->max_pending = 0;
+        pthread_mutex_unlock(&capture->lock);
+        write_batch(capture, batch, n_batch);
+        free(batch);
+        pthread_mutex_lock(&capture->lock);
+        if(capture->stopping){
+            break;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CAPTURE_DRAIN_POLL_MS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&capture->stop, &capture->lock, &deadline);
+    }
+    pthread_mutex_unlock(&capture->lock);
+    return NULL;
+}
+
+int capture_open(capture_t *capture, const char *path) {
+    capture_file_header_t header;
+    struct timespec wall;
+    int result;
+
+    memset(capture,0,sizeof(*capture));
+    if((capture->out = fopen(path, "wb")) == NULL){
+        perror("fopen");
+        return -1;
+    }
+    setvbuf(capture->out, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);  // Records are small, let each tick's batch go out in one write
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    capture->start_ns = now_ns();
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.start_unix_ns = (uint64_t) wall.tv_sec * 1000000000ull + wall.tv_nsec;
+    if(fwrite(&header, sizeof(header), 1, capture->out) != 1){
+        perror("fwrite");
+        fclose(capture->out);
+        return -1;
+    }
+
+    if((result = pthread_mutex_init(&capture->lock,NULL)) != 0){
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(result));
+        fclose(capture->out);
+        return -1;
+    }
+    if((result = pthread_cond_init(&capture->stop,NULL)) != 0){
+        fprintf(stderr, "pthread_cond_init: %s\n", strerror(result));
+        pthread_mutex_destroy(&capture->lock);
+        fclose(capture->out);
+        return -1;
+    }
+    return 0;
+}
+
+int capture_start(capture_t *capture) {
+    int result;
+    if((result = pthread_create(&capture->drain_thread,NULL,drain_thread_func,capture)) != 0){
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        return -1;
+    }
+    capture->drain_started = 1;
+    return 0;
+}
+
+void capture_request(capture_t *capture, int fd, uint64_t accepted_ns, const char *resource_name, const char *head,
+    int status, long response_bytes, int complete, uint64_t started_ns, uint64_t finished_ns) {
+    size_t path_len = strlen(resource_name);
+    size_t head_len = (head != NULL) ? strlen(head) : 0;
+
+    path_len = (path_len > UINT16_MAX) ? UINT16_MAX : path_len;
+    head_len = (head_len > UINT16_MAX) ? UINT16_MAX : head_len;
+    capture_record_t *record = calloc(1, sizeof(capture_record_t) + path_len + head_len);
+    if(record == NULL){
+        perror("calloc");
+        return;
+    }
+    record->arrival_ns = (accepted_ns > capture->start_ns) ? accepted_ns - capture->start_ns : 0;
+    record->service_ns = finished_ns - started_ns;
+    record->status = status;
+    record->response_bytes = (response_bytes > UINT32_MAX) ? UINT32_MAX : response_bytes;
+    record->path_len = path_len;
+    record->head_len = head_len;
+    record->flags = complete ? 0 : CAPTURE_INCOMPLETE;
+    memcpy((char *) (record + 1), resource_name, path_len);
+    memcpy((char *) (record + 1) + path_len, head, head_len);
+
+    // Socket buffers swallow most of a response before the client reads any of it,
+    // so time the acknowledgements instead of the writes for large responses.
+    // Either way the drain thread writes the record, the worker never waits on the file.
+    int dup_fd = -1;
+    pthread_mutex_lock(&capture->lock);
+    if(complete && response_bytes >= CAPTURE_RATE_MIN_BYTES && capture->drain_started && !capture->stopping
+        && capture->n_draining < CAPTURE_MAX_DRAINING && (dup_fd = dup(fd)) != -1){
+        shutdown(fd, SHUT_WR);  // Sends the FIN now, the duplicate would otherwise hold it back after the worker's close()
+        capture_draining_t *d = &capture->draining[capture->n_draining++];
+        d->fd = dup_fd;
+        d->started_ns = started_ns;
+        d->record = record;
+    }
+    else{
+        add_pending(capture, record);
+    }
+    pthread_mutex_unlock(&capture->lock);
+}
+
+int capture_close(capture_t *capture) {
+    int return_val = 0;
+    int result;
+
+    pthread_mutex_lock(&capture->lock);
+    capture->stopping = 1;
+    pthread_cond_broadcast(&capture->stop);
+    pthread_mutex_unlock(&capture->lock);
+    if(capture->drain_started && (result = pthread_join(capture->drain_thread,NULL)) != 0){
+        fprintf(stderr, "pthread_join: %s\n", strerror(result));
+        return_val = -1;
+    }
+    while(capture->n_draining > 0){ // Record whatever the clients acknowledged so far
+        finish_draining(capture, capture->n_draining - 1, now_ns());
+    }
+    write_batch(capture, capture->pending, capture->n_pending);
+    free(capture->pending);
+    capture->pending = NULL;
+    capture->n_pending = capture->max_pending = 0;
+
+    if(fclose(capture->out) != 0){
+        perror("fclose");
+        return_val = -1;
+    }
+    capture->out = NULL;
+    pthread_cond_destroy(&capture->stop);
+    if((result = pthread_mutex_destroy(&capture->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(result));
+        return_val = -1;
+    }
+    return return_val;
+}
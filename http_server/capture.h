@@ -0,0 +1,105 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "HTCAPT01"
+#define CAPTURE_RATE_MIN_BYTES (64 * 1024)      // Smaller responses are gone in one window and say nothing about the reader
+#define CAPTURE_MAX_DRAINING 256                // Large responses watched at once while the client drains them
+#define CAPTURE_DRAIN_POLL_MS 10
+#define CAPTURE_DRAIN_TIMEOUT_NS (30 * 1000000000ull)
+
+// capture_record_t flags
+#define CAPTURE_INCOMPLETE 0x1  // The response was cut short, e.g. the client hung up; response_bytes is what was sent
+
+/*
+ * Capture file layout, all integers little-endian:
+ *   capture_file_header_t
+ *   then per request: capture_record_t, path bytes, head bytes
+ * 'head' is the raw request after the method, i.e. the rest of the request
+ * line and the headers, so a replay can resend it as "GET " + head.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t start_unix_ns;     // Wall clock time the capture started
+} capture_file_header_t;
+
+typedef struct {
+    uint64_t arrival_ns;        // When the connection was accepted, relative to the capture start
+    uint64_t service_ns;        // From the start of the response until it was fully written
+    uint32_t read_rate;         // Bytes/sec the client acknowledged the response at, 0 if not measured
+    uint32_t response_bytes;
+    uint16_t status;            // 0 if nothing was sent
+    uint16_t path_len;
+    uint16_t head_len;
+    uint16_t flags;             // CAPTURE_* flags
+} capture_record_t;
+
+// A large response whose record is held back until the client has acknowledged it
+typedef struct {
+    int fd;                     // Duplicate of the client socket, keeps it queryable after the worker closes it
+    uint64_t started_ns;
+    capture_record_t *record;   // Followed by the path and head bytes
+} capture_draining_t;
+
+// Struct representing an open capture file shared by the worker threads
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    FILE *out;
+    uint64_t start_ns;          // CLOCK_MONOTONIC at capture start
+    unsigned long records;
+    capture_draining_t draining[CAPTURE_MAX_DRAINING];
+    int n_draining;
+    capture_record_t **pending; // Finished records waiting for the drain thread to write them
+    int n_pending;
+    int max_pending;
+    int stopping;
+    pthread_t drain_thread;
+    int drain_started;
+} capture_t;
+
+/*
+ * Create a capture file and start recording.
+ * capture: Pointer to capture_t to be initialized
+ * path: The capture file to create, replaced if it exists
+ * Returns 0 on success or -1 on error
+ */
+int capture_open(capture_t *capture, const char *path);
+
+/*
+ * Start the thread that measures how fast clients drain large responses and
+ * writes the finished records to the file, flushing every CAPTURE_DRAIN_POLL_MS
+ * Returns 0 on success or -1 on error
+ */
+int capture_start(capture_t *capture);
+
+/*
+ * Append one served request to the capture. The record is queued for the drain
+ * thread to write. Complete responses of at least CAPTURE_RATE_MIN_BYTES are
+ * shut down for writing and watched until the client has acknowledged every
+ * byte, which gives the client's read rate; their record is queued then. The
+ * caller still closes 'fd' as usual.
+ * fd: The client socket's file descriptor
+ * accepted_ns: now_ns() when the connection was accepted
+ * resource_name: The requested resource name
+ * head: The raw request from read_http_request_head()
+ * status: The response status, or 0 if nothing was sent
+ * response_bytes: The number of bytes written to the client
+ * complete: 0 if the response failed part way, which marks the record CAPTURE_INCOMPLETE
+ * started_ns: now_ns() when the response started
+ * finished_ns: now_ns() when the response was fully written or failed
+ */
+void capture_request(capture_t *capture, int fd, uint64_t accepted_ns, const char *resource_name, const char *head,
+    int status, long response_bytes, int complete, uint64_t started_ns, uint64_t finished_ns);
+
+/*
+ * Stop the drain thread, write any records still being watched, then flush
+ * and close the capture file and free its resources.
+ * Returns 0 on success or -1 on error
+ */
+int capture_close(capture_t *capture);
+
+#endif // CAPTURE_H
@@ -0,0 +1,58 @@
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "conn.h"
+#include "util.h"
+
+static conn_t *conns = NULL;    // Indexed by socket file descriptor
+static int max_fds = 0;
+static uint64_t next_conn_id = 1;
+
+int conn_init(void) {
+    struct rlimit rlim;
+    if(getrlimit(RLIMIT_NOFILE,&rlim) == -1){   // Size the table to the largest fd accept() can return
+        perror("getrlimit");
+        return -1;
+    }
+    max_fds = (rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > 1 << 20) ? 1 << 20 : (int) rlim.rlim_cur;
+    if((conns = calloc(max_fds, sizeof(conn_t))) == NULL){
+        perror("calloc");
+        max_fds = 0;
+        return -1;
+    }
+    return 0;
+}
+
+conn_t *conn_accept(int fd, const struct sockaddr *addr) {
+    uint64_t h = 0;
+    if(fd < 0 || fd >= max_fds){
+        return NULL;
+    }
+    conn_t *conn = &conns[fd];
+    memset(conn,0,sizeof(*conn));  // Nothing of the fd's previous connection may leak into this one
+    conn->id = next_conn_id++;      // Only the accepting thread hands out ids
+    conn->accepted_ns = now_ns();
+    if(addr->sa_family == AF_INET){
+        h = fnv1a(FNV1A_INIT, &((const struct sockaddr_in *) addr)->sin_addr, sizeof(struct in_addr));
+    }
+    else if(addr->sa_family == AF_INET6){
+        h = fnv1a(FNV1A_INIT, &((const struct sockaddr_in6 *) addr)->sin6_addr, sizeof(struct in6_addr));
+    }
+    conn->client = (uint32_t) (h ^ (h >> 32));
+    return conn;
+}
+
+conn_t *conn_lookup(int fd) {
+    if(fd < 0 || fd >= max_fds){
+        return NULL;
+    }
+    return &conns[fd];
+}
+
+void conn_free(void) {
+    free(conns);
+    conns = NULL;
+    max_fds = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "rate_limit.h"
+
+// What the server knows about one accepted connection. Filled in by the
+// accepting thread and handed to the worker through the queue's mutex.
+typedef struct {
+    uint64_t id;            // Connection id, the first argument of every trace probe
+    uint64_t accepted_ns;   // now_ns() when the connection was accepted
+    uint32_t client;        // Hash of the peer address, 0 if the family is unknown
+    rl_hold_t limits;       // Keys charged by rate_limit_acquire()
+} conn_t;
+
+/*
+ * Allocate the table of connection records, indexed by socket file descriptor
+ * Returns 0 on success or -1 on error
+ */
+int conn_init(void);
+
+/*
+ * Start the record for a newly accepted socket. Called by the accepting thread.
+ * fd: The accepted socket's file descriptor
+ * addr: The peer address returned by accept()
+ * Returns the record, or NULL if 'fd' is too large for the table
+ */
+conn_t *conn_accept(int fd, const struct sockaddr *addr);
+
+/*
+ * Look up the record started by conn_accept()
+ * fd: The socket's file descriptor
+ * Returns the record, or NULL if 'fd' is too large for the table
+ */
+conn_t *conn_lookup(int fd);
+
+/*
+ * Deallocates the table of connection records
+ */
+void conn_free(void);
+
+#endif // CONN_H
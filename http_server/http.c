@@ -4,8 +4,11 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "http.h"
+#include "trace.h"
 
 #define BUFSIZE 512
 
@@ -25,14 +28,28 @@ const char *get_mime_type(const char *file_extension) {
     return NULL;
 }
 
+const char *get_mime_type_for_path(const char *path) {
+    const char *name = strrchr(path, '/');
+    const char *ext = strrchr(name != NULL ? name : path, '.'); // Extension of the file name only, never of a directory
+    return (ext != NULL) ? get_mime_type(ext) : NULL;
+}
+
 int read_http_request(int fd, char *resource_name) {
+    return read_http_request_head(fd,resource_name,NULL,0);
+}
+
+int read_http_request_head(int fd, char *resource_name, char *head, int head_size) {
     char buff[BUFSIZE];
     const char s[2] = " ";
     char *token;
     char oper_buffer[4];    // For cheking requested operation is GET
     int read_bytes=0;
     int execute_token = 1;
+    int head_len = 0;
     memset(buff,'\0',sizeof(buff)); // Initialize buff with null-terminator character before using it
+    if(head != NULL && head_size > 0){
+        head[0] = '\0';
+    }
 
     if(read(fd,oper_buffer,4) == -1){   // Read first 4 bytes including space character from socket to figure out requested operation
         perror("read");
@@ -44,13 +61,21 @@ int read_http_request(int fd, char *resource_name) {
         return -1;
     }
 
-    while((read_bytes = read(fd,buff,BUFSIZE))>0){
+    while((read_bytes = read(fd,buff,BUFSIZE-1))>0){
+        buff[read_bytes] = '\0';   // Keep strtok from running past the bytes just read
+        if(head != NULL && head_len < head_size - 1){   // Keep a copy of the raw bytes before strtok modifies them
+            int n = (read_bytes < head_size - 1 - head_len) ? read_bytes : head_size - 1 - head_len;
+            memcpy(head + head_len, buff, n);
+            head_len += n;
+            head[head_len] = '\0';
+        }
         if(execute_token == 1){ // Use strtok to extract resource part like "/quote.txt" from HTTP request
             token = strtok(buff,s);
             while(token != NULL){
                 if (token[0] == '/'){
                     execute_token = 0;
                     strcpy(resource_name,token);    // Copy the found resource name from token to resource_name
+                    TRACE_REQUEST_PARSED(trace_conn_id,resource_name);
                     break;  // Break the while loop after tokenize the resource part
                 }
                 token = strtok(NULL,s);
@@ -73,20 +98,133 @@ int read_http_request(int fd, char *resource_name) {
     return 0;
 }
 
-int write_http_response(int fd, const char *resource_path) {
-    struct stat st;
+int http_get_header(const char *head, const char *name, char *value, int value_size) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(head, "\n");  // Skip the request line
+
+    while(line != NULL){
+        line++;
+        if(strncasecmp(line,name,name_len) == 0 && line[name_len] == ':'){
+            const char *start = line + name_len + 1;
+            while(*start == ' ' || *start == '\t'){
+                start++;
+            }
+            int len = strcspn(start, "\r\n");
+            if(len > value_size - 1){
+                len = value_size - 1;
+            }
+            memcpy(value, start, len);
+            value[len] = '\0';
+            return 0;
+        }
+        line = strstr(line, "\n");
+    }
+    return -1;
+}
+
+int write_bundle_response(int fd, const bundle_t *bundle, const char *resource_name, const char *head, const char *extra_headers,
+    int *status, long *bytes_sent) {
+    char *not_found = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    char *not_modified = "HTTP/1.0 304 Not Modified\r\nETag: %s\r\n\r\n";
     char buff[BUFSIZE];
+    char value[BUFSIZE];
+    struct iovec iov[4];
+    int n_iov = 2;
+    int code = 200;
+
+    *status = 0;
+    *bytes_sent = 0;
+
+    const bundle_entry_t *entry = bundle_lookup(bundle,resource_name);
+    if(entry == NULL){
+        iov[0].iov_base = not_found;
+        iov[0].iov_len = strlen(not_found);
+        iov[1].iov_len = 0;
+        code = 404;
+    }
+    else{
+        // Pick the variant first, each one carries its own ETag
+        int gzip = entry->gz_body_len > 0 && head != NULL && http_get_header(head,"Accept-Encoding",value,sizeof(value)) == 0 && strstr(value,"gzip") != NULL;
+        snprintf(buff, sizeof(buff), "\"%016llx%s\"", (unsigned long long) entry->etag, gzip ? "-gz" : "");
+        if(head != NULL && http_get_header(head,"If-None-Match",value,sizeof(value)) == 0 && strstr(value,buff) != NULL){
+            iov[0].iov_len = snprintf(value, sizeof(value), not_modified, buff);
+            iov[0].iov_base = value;
+            iov[1].iov_len = 0;
+            code = 304;
+        }
+        else if(gzip){
+            iov[0].iov_base = (char *) bundle->strings + entry->gz_header_off;
+            iov[0].iov_len = entry->gz_header_len;
+            iov[1].iov_base = (char *) bundle->base + entry->gz_body_off;
+            iov[1].iov_len = entry->gz_body_len;
+        }
+        else{
+            iov[0].iov_base = (char *) bundle->strings + entry->header_off;
+            iov[0].iov_len = entry->header_len;
+            iov[1].iov_base = (char *) bundle->base + entry->body_off;
+            iov[1].iov_len = entry->body_len;
+        }
+        if(code == 200 && extra_headers != NULL && extra_headers[0] != '\0'){   // Splice the extra lines in before the blank line ending the stored headers
+            iov[3] = iov[1];
+            iov[0].iov_len -= 2;
+            iov[1].iov_base = (char *) extra_headers;
+            iov[1].iov_len = strlen(extra_headers);
+            iov[2].iov_base = "\r\n";
+            iov[2].iov_len = 2;
+            n_iov = 4;
+        }
+    }
+
+    // Headers and body go out straight from the mapping, usually in a single writev() call
+    int iov_idx = 0;
+    while(iov_idx < n_iov){
+        ssize_t written = writev(fd, iov + iov_idx, n_iov - iov_idx);
+        if(written == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("writev");
+            return -1;
+        }
+        if(*bytes_sent == 0 && written > 0){
+            TRACE_FIRST_BYTE(trace_conn_id);
+            *status = code;
+        }
+        *bytes_sent += written;
+        while(iov_idx < n_iov && (size_t) written >= iov[iov_idx].iov_len){ // Skip fully written vectors, advance into a partial one
+            written -= iov[iov_idx].iov_len;
+            iov_idx++;
+        }
+        if(iov_idx < n_iov){
+            iov[iov_idx].iov_base = (char *) iov[iov_idx].iov_base + written;
+            iov[iov_idx].iov_len -= written;
+        }
+    }
+    TRACE_RESPONSE_COMPLETE(trace_conn_id,code,*bytes_sent);
+    return 0;
+}
+
+int write_http_response(int fd, const char *resource_path, const char *extra_headers, int *status, long *bytes_sent) {
+    struct stat st;
+    char buff[BUFSIZE + HTTP_EXTRA_HEADERS_SIZE];
     char *not_found = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-    char *found = "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n";
+    char *found = "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\n%s\r\n";
     
     memset(buff,0,sizeof(buff));    // Initialize before using it
+    *status = 0;
+    *bytes_sent = 0;
 
     if(stat(resource_path,&st) == -1){  // Use stat() to get information about the specific file
             if(errno == ENOENT){    // Error occured because there is no such file
-                if(write(fd,not_found,strlen(not_found)) == -1){ // Simply write HTTP response to the socket
+                ssize_t written = write(fd,not_found,strlen(not_found));
+                if(written == -1){ // Simply write HTTP response to the socket
                     perror("write");
                     return -1;
                 }
+                TRACE_FIRST_BYTE(trace_conn_id);
+                *status = 404;
+                *bytes_sent = written;
+                TRACE_RESPONSE_COMPLETE(trace_conn_id,404,written);
                 return 0;
             }
             else{   // Error occured because of other reasons eventhough the specified file exists
@@ -100,24 +238,9 @@ int write_http_response(int fd, const char *resource_path) {
             perror("open");
             return -1;
         }
-        
-        int ind = 0;
-        for(int i=0; i<strlen(resource_path); i++){ // Find the index of occurence of "."
-            if(resource_path[i] == '.'){
-                buff[ind] = resource_path[i];
-                ind++;
-                for(int j=i+1; j<strlen(resource_path);j++){    // Append rest of characters after "." to buff
-                    buff[ind] = resource_path[j];
-                    ind++;
-                }
-            }
-            else{
-                continue;
-            }
-            break;
-        }
+        TRACE_FILE_OPEN(trace_conn_id,resource_path,file_fd);
 
-        const char *get_mime = get_mime_type(buff);   // Get mime type from extension
+        const char *get_mime = get_mime_type_for_path(resource_path);   // Get mime type from extension
         if(get_mime == NULL){   // There is no matching mime type
             printf("Invalid extension\n");
             if(close(file_fd) == -1){
@@ -127,25 +250,33 @@ int write_http_response(int fd, const char *resource_path) {
         }
         memset(buff,0,sizeof(buff));    // Initialize before reusing it
         int bytes = 0;
-        if((bytes = snprintf(buff, sizeof(buff), found, get_mime,st.st_size))<0){
+        if((bytes = snprintf(buff, sizeof(buff), found, get_mime,(long long) st.st_size,extra_headers != NULL ? extra_headers : ""))<0){
             perror("snprintf");
         }
-        if(write(fd,buff,bytes) == -1){ // Write HTTP response to socket up to start of actual response body
+        if(bytes >= sizeof(buff)){  // Extra headers too long, send the response without them
+            bytes = snprintf(buff, sizeof(buff), found, get_mime,(long long) st.st_size,"");
+        }
+        ssize_t written;
+        if((written = write(fd,buff,bytes)) == -1){ // Write HTTP response to socket up to start of actual response body
             perror("write");
             if(close(file_fd) == -1){
                 perror("close");
             }
             return -1;
         }
+        TRACE_FIRST_BYTE(trace_conn_id);
+        *status = 200;
+        *bytes_sent = written;
         memset(buff,0,sizeof(buff));    // Initialize before reusing it for reading data from the specified file
         while((bytes = read(file_fd,buff,BUFSIZE))>0){  // Read data from the file
-            if(write(fd,buff,bytes) == -1){ // Write read data to socket
+            if((written = write(fd,buff,bytes)) == -1){ // Write read data to socket
                 perror("write");
                 if(close(file_fd) == -1){
                     perror("close");
                 }
                 return -1;
             }
+            *bytes_sent += written;
         }
         if(bytes == -1){    // Check reading is finished because of occurence of error or because of reaching end of file
             perror("read");
@@ -158,6 +289,7 @@ int write_http_response(int fd, const char *resource_path) {
             perror("close");
             return -1;
         }
+        TRACE_RESPONSE_COMPLETE(trace_conn_id,200,*bytes_sent);
     }
     return 0;
 }
@@ -1,6 +1,24 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include "bundle.h"
+
+#define HTTP_HEAD_SIZE 4096
+#define HTTP_EXTRA_HEADERS_SIZE 1024
+
+/*
+ * Map a file extension such as ".txt" to its MIME type
+ * Returns the MIME type, or NULL if the extension is not served
+ */
+const char *get_mime_type(const char *file_extension);
+
+/*
+ * Map a file path to its MIME type using the last extension of its file name,
+ * e.g. "/a.b.txt" is "text/plain". Used wherever a served file is classified.
+ * Returns the MIME type, or NULL if the file is not served
+ */
+const char *get_mime_type_for_path(const char *path);
+
 /*
  * Read an HTTP request from an active TCP connection socket
  * fd: The socket's file descriptor
@@ -9,12 +27,52 @@
  */
 int read_http_request(int fd, char *resource_name);
 
+/*
+ * Same as read_http_request(), but also keeps the raw request bytes that
+ * followed the method, i.e. the rest of the request line and the headers
+ * fd: The socket's file descriptor
+ * resource_name: Set to the name of the requested resource on success
+ * head: Set to the NUL-terminated raw request, truncated to fit
+ * head_size: Size of the 'head' buffer
+ * Returns 0 on success or -1 on error
+ */
+int read_http_request_head(int fd, char *resource_name, char *head, int head_size);
+
+/*
+ * Find a header in a request kept by read_http_request_head()
+ * head: The raw request
+ * name: The header name, matched case-insensitively
+ * value: Set to the header's value with leading whitespace removed
+ * value_size: Size of the 'value' buffer
+ * Returns 0 if the header was found or -1 otherwise
+ */
+int http_get_header(const char *head, const char *name, char *value, int value_size);
+
 /*
  * Write an HTTP response to an active TCP connection socket
  * fd: The socket's file descriptor
  * resource_path: The path to the requested resource in the server's file system
+ * extra_headers: "\r\n"-terminated header lines added to a 200 response, or NULL
+ * status: Set to the status code sent, or 0 if nothing was sent
+ * bytes_sent: Set to the number of bytes written to the socket, also on error
+ * Returns 0 on success or -1 on error
+ */
+int write_http_response(int fd, const char *resource_path, const char *extra_headers, int *status, long *bytes_sent);
+
+/*
+ * Write an HTTP response for a resource stored in a content bundle, using the
+ * bundle's precomputed headers. A gzip variant is sent if the bundle has one and
+ * the request accepts it; a matching If-None-Match gets 304 Not Modified.
+ * fd: The socket's file descriptor
+ * bundle: The bundle to serve from
+ * resource_name: The requested resource name, e.g. "/quote.txt"
+ * head: The raw request from read_http_request_head(), or NULL
+ * extra_headers: "\r\n"-terminated header lines added to a 200 response, or NULL
+ * status: Set to the status code sent, or 0 if nothing was sent
+ * bytes_sent: Set to the number of bytes written to the socket, also on error
  * Returns 0 on success or -1 on error
  */
-int write_http_response(int fd, const char *resource_path);
+int write_bundle_response(int fd, const bundle_t *bundle, const char *resource_name, const char *head, const char *extra_headers,
+    int *status, long *bytes_sent);
 
 #endif // HTTP_H
@@ -1,32 +1,127 @@
 #include <errno.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "bundle.h"
+#include "capture.h"
+#include "conn.h"
 #include "connection_queue.h"
 #include "http.h"
+#include "prewarm.h"
+#include "proxy.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include "util.h"
 
 #define BUFSIZE 512
 #define LISTEN_QUEUE_LEN 5
 #define N_THREADS 5
 
 int keep_going = 1;
+volatile sig_atomic_t dump_stats = 0;
+volatile sig_atomic_t reload_bundle = 0;
 const char *serve_dir;
+const char *bundle_path = NULL;  // Serve from this bundle instead of serve_dir when set
+bundle_store_t bundles;
+proxy_t proxy;
+prewarm_t prewarm;
+int prewarm_on = 0;
+capture_t capture;
+const char *capture_path = NULL;   // Record served requests here when set
+rate_limiter_t limiter;
+int reject_with_close = 0;
+
+static const char *too_many = "HTTP/1.0 429 Too Many Requests\r\nContent-Length: 0\r\nRetry-After: 1\r\n\r\n";
+
+static struct option long_options[] = {
+    {"max-conns-ip", required_argument, NULL, 'c'},
+    {"max-conns-prefix", required_argument, NULL, 'p'},
+    {"rate-ip", required_argument, NULL, 'r'},
+    {"burst-ip", required_argument, NULL, 'b'},
+    {"rate-prefix", required_argument, NULL, 'R'},
+    {"burst-prefix", required_argument, NULL, 'U'},
+    {"reject-close", no_argument, NULL, 'x'},
+    {"bundle", required_argument, NULL, 'B'},
+    {"proxy", required_argument, NULL, 'P'},
+    {"upstream-timeout", required_argument, NULL, 'T'},
+    {"prewarm", no_argument, NULL, 'W'},
+    {"link-preload", no_argument, NULL, 'L'},
+    {"hot-set", required_argument, NULL, 'H'},
+    {"capture", required_argument, NULL, 'C'},
+    {NULL, 0, NULL, 0}
+};
 
 void handle_sigint(int signo) {
     keep_going = 0;
 }
 
+void handle_sigusr1(int signo) {
+    dump_stats = 1;
+}
+
+void handle_sighup(int signo) {
+    reload_bundle = 1;
+}
+
+void print_usage(const char *prog) {
+    printf("Usage: %s [options] <directory> <port>\n", prog);
+    printf("       %s [options] --bundle <file> <port>\n", prog);
+    printf("  -B, --bundle FILE          serve a bundle built by bundle_pack; SIGHUP reloads it\n");
+    printf("  -P, --proxy PREFIX=HOST:PORT[,HOST:PORT...]\n");
+    printf("                             forward paths under PREFIX to backends (repeatable)\n");
+    printf("  -T, --upstream-timeout MS  backend read/write timeout (default %d)\n", PROXY_IO_TIMEOUT_MS);
+    printf("  -W, --prewarm              learn which resources follow each other and prefetch them\n");
+    printf("  -L, --link-preload         also send Link: preload/prefetch hints (implies -W)\n");
+    printf("  -H, --hot-set FILE         rewarm from FILE at startup, save to it at shutdown (implies -W)\n");
+    printf("  -C, --capture FILE         record served requests to FILE for the replay tool\n");
+    printf("  -c, --max-conns-ip N       concurrent connections per client address\n");
+    printf("  -p, --max-conns-prefix N   concurrent connections per /24 or /64 prefix\n");
+    printf("  -r, --rate-ip R            connections per second per client address\n");
+    printf("  -b, --burst-ip B           burst allowed above --rate-ip\n");
+    printf("  -R, --rate-prefix R        connections per second per prefix\n");
+    printf("  -U, --burst-prefix B       burst allowed above --rate-prefix\n");
+    printf("  -x, --reject-close         close rejected connections instead of sending 429\n");
+    printf("Limits default to 0 (disabled). Send SIGUSR1 to print rejection and backend counters.\n");
+}
+
+// Send the 429 to a rejected connection without reading its request. Closing a
+// socket with unread data makes the kernel answer with a reset that can overtake
+// the 429, so send our FIN first and discard whatever part of the request has
+// already arrived. The accept loop must not block, so anything arriving after
+// that can still cause a reset; -x avoids the problem entirely.
+void reject_connection(int fd) {
+    char discard[BUFSIZE];
+    send(fd,too_many,strlen(too_many),MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd,SHUT_WR);
+    while(recv(fd,discard,sizeof(discard),MSG_DONTWAIT) > 0){
+        continue;
+    }
+}
+
+// Release the connection's rate limit slots and close it
+void close_connection(int fd) {
+    conn_t *conn = conn_lookup(fd);
+    TRACE_CLOSE(conn->id,fd);
+    rate_limit_release(&limiter,&conn->limits);
+    close(fd);
+}
+
 
 // Thread start function
 void *consumer_thread_func(void *arg) {
     char buffer[BUFSIZE];
+    char head[HTTP_HEAD_SIZE];
+    char link[HTTP_EXTRA_HEADERS_SIZE];
+    prewarm_plan_t plan;
     connection_queue_t *ar = (connection_queue_t *) arg;
 
     while(1){
@@ -40,8 +135,11 @@ void *consumer_thread_func(void *arg) {
                 break;
             }
         }
-        if(read_http_request(fd,buffer) == -1){
-            close(fd);
+        conn_t *conn = conn_lookup(fd);  // Filled in at accept, the fd is only queued if it fit the table
+        trace_conn_id = conn->id;   // Lets the probes in http.c tag events with this connection
+        TRACE_DEQUEUE(trace_conn_id,fd);
+        if(read_http_request_head(fd,buffer,head,sizeof(head)) == -1){
+            close_connection(fd);
             if(ar->shutdown != 1){  // Keep going if shutdown is not true
                 continue;
             }
@@ -50,12 +148,50 @@ void *consumer_thread_func(void *arg) {
             }
         }
 
-        char resource_path[BUFSIZ];
-        strcpy(resource_path,serve_dir); // Copy serve_dir to resource_path
-        strcat(resource_path,buffer);    // Append HTTP request resource name at the end of resource_path
+        int response_result;
+        int status;
+        long bytes_sent;
+        uint64_t started_ns = (capture_path != NULL) ? now_ns() : 0;
+        proxy_route_t *route = proxy_match(&proxy,buffer);
+        if(route != NULL){
+            response_result = proxy_forward(&proxy,route,fd,buffer,head,&status,&bytes_sent);
+        }
+        else if(bundle_path != NULL){    // Hold the bundle for the whole response so a swap can't unmap it underneath us
+            bundle_t *bundle = bundle_acquire(&bundles);
+            if(prewarm_on){ // Hint what usually comes next in this response
+                prewarm_request(&prewarm,buffer,link,sizeof(link),&plan);
+            }
+            response_result = write_bundle_response(fd,bundle,buffer,head,prewarm_on ? link : NULL,&status,&bytes_sent);
+            if(prewarm_on){ // The response is out, warm the next requests before they arrive
+                prewarm_prefetch(&prewarm,&plan,bundle);
+            }
+            if(prewarm_on && response_result == 0){
+                prewarm_record(&prewarm,conn->client,buffer,status);
+            }
+            bundle_release(&bundles,bundle);
+        }
+        else{
+            char resource_path[BUFSIZ];
+            strcpy(resource_path,serve_dir); // Copy serve_dir to resource_path
+            strcat(resource_path,buffer);    // Append HTTP request resource name at the end of resource_path
+            if(prewarm_on){ // Hint what usually comes next in this response
+                prewarm_request(&prewarm,buffer,link,sizeof(link),&plan);
+            }
+            response_result = write_http_response(fd,resource_path,prewarm_on ? link : NULL,&status,&bytes_sent);
+            if(prewarm_on){ // The response is out, warm the next requests before they arrive
+                prewarm_prefetch(&prewarm,&plan,NULL);
+            }
+            if(prewarm_on && response_result == 0){
+                prewarm_record(&prewarm,conn->client,buffer,status);
+            }
+        }
+
+        if(capture_path != NULL){   // Failed responses too, with what actually reached the client
+            capture_request(&capture,fd,conn->accepted_ns,buffer,head,status,bytes_sent,response_result == 0,started_ns,now_ns());
+        }
 
-        if(write_http_response(fd,resource_path) == -1){
-            close(fd);
+        if(response_result == -1){
+            close_connection(fd);
             if(ar->shutdown != 1){  // Keep going if shutdown is not true
                 continue;
             }
@@ -63,7 +199,7 @@ void *consumer_thread_func(void *arg) {
                 break;
             }
         }else{  // No error occured in calling above functions
-            close(fd);
+            close_connection(fd);
         }
     }
     return NULL;
@@ -71,23 +207,109 @@ void *consumer_thread_func(void *arg) {
 
 
 int main(int argc, char **argv) {
-    // First command is directory to serve, second command is port
-    if (argc != 3) {
-        printf("Usage: %s <directory> <port>\n", argv[0]);
+    rate_limit_config_t limits;
+    const char *hot_set_path = NULL;
+    int link_preload = 0;
+    int opt;
+
+    if (proxy_init(&proxy) != 0) {  // Routes are added while parsing the options
+        fprintf(stderr, "Failed to initialize proxy\n");
         return 1;
     }
-    // Uncomment the lines below to use these definitions:
-    serve_dir = argv[1];
-    const char *port = argv[2];
+
+    memset(&limits,0,sizeof(limits));   // Every limit is disabled unless given on the command line
+    while((opt = getopt_long(argc,argv,"c:p:r:b:R:U:xB:P:T:WLH:C:",long_options,NULL)) != -1){
+        switch(opt){
+            case 'c': limits.max_conns_ip = atoi(optarg); break;
+            case 'p': limits.max_conns_prefix = atoi(optarg); break;
+            case 'r': limits.rate_ip = atof(optarg); break;
+            case 'b': limits.burst_ip = atof(optarg); break;
+            case 'R': limits.rate_prefix = atof(optarg); break;
+            case 'U': limits.burst_prefix = atof(optarg); break;
+            case 'x': reject_with_close = 1; break;
+            case 'B': bundle_path = optarg; break;
+            case 'P':
+                if(proxy_add_route(&proxy,optarg) != 0){
+                    return 1;
+                }
+                break;
+            case 'T':
+                if((proxy.io_timeout_ms = atoi(optarg)) <= 0){  // 0 would switch the socket timeouts off
+                    fprintf(stderr, "Upstream timeout must be a positive number of milliseconds\n");
+                    return 1;
+                }
+                break;
+            case 'W': prewarm_on = 1; break;
+            case 'L': prewarm_on = link_preload = 1; break;
+            case 'H': prewarm_on = 1; hot_set_path = optarg; break;
+            case 'C': capture_path = optarg; break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // First command is directory to serve, second command is port. A bundle replaces the directory.
+    if (argc - optind != (bundle_path != NULL ? 1 : 2)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    serve_dir = (bundle_path != NULL) ? NULL : argv[optind];
+    const char *port = argv[argc - 1];
     connection_queue_t con_queue;   // Shared resource queue
     pthread_t cons_thr[N_THREADS];   // Declare consumer threads
     int result;
 
+    if (conn_init() != 0) {
+        fprintf(stderr, "Failed to allocate connection records\n");
+        return 1;
+    }
+
+    if (bundle_path != NULL && bundle_store_init(&bundles,bundle_path) != 0) {
+        fprintf(stderr, "Failed to load bundle %s\n", bundle_path);
+        return 1;
+    }
+
+    if (prewarm_on) {
+        if (prewarm_init(&prewarm,serve_dir,hot_set_path,link_preload) != 0) {
+            fprintf(stderr, "Failed to initialize prewarming\n");
+            return 1;
+        }
+        bundle_t *bundle = (bundle_path != NULL) ? bundle_acquire(&bundles) : NULL;
+        int n_warm = prewarm_load(&prewarm,bundle);
+        if (bundle != NULL) {
+            bundle_release(&bundles,bundle);
+        }
+        if (n_warm > 0) {
+            printf("Prewarmed %d paths from %s\n", n_warm, hot_set_path);
+        }
+    }
+
+    if (capture_path != NULL && capture_open(&capture,capture_path) != 0) {
+        fprintf(stderr, "Failed to open capture file %s\n", capture_path);
+        return 1;
+    }
+
+    if (rate_limit_init(&limiter,&limits) != 0) {   // Initialize limiter before any worker can release into it
+        fprintf(stderr, "Failed to initialize rate limiter\n");
+        return 1;
+    }
+
     if (connection_queue_init(&con_queue) != 0) {   // Initialize con_queue before using it
         fprintf(stderr, "Failed to initialize queue\n");
         return 1;
     }
 
+    // Set before any worker or proxy thread exists. A client hanging up mid-response
+    // must fail that write() or the proxy's splice() with EPIPE, not kill the server.
+    struct sigaction ignore_pipe;
+    memset(&ignore_pipe,0,sizeof(ignore_pipe));
+    ignore_pipe.sa_handler = SIG_IGN;
+    if(sigaction(SIGPIPE, &ignore_pipe, NULL) == -1){
+        perror("sigaction");
+        return 1;
+    }
+
     sigset_t old_mask, new_mask;
     if(sigfillset(&new_mask) == -1){    // Fill all possible signals
         perror("sigfillset");
@@ -109,6 +331,12 @@ int main(int argc, char **argv) {
             return 1;
         }
     }
+    if(proxy_start(&proxy) != 0){   // Started with signals blocked too, like the consumer threads
+        return 1;
+    }
+    if(capture_path != NULL && capture_start(&capture) != 0){
+        return 1;
+    }
     if(sigprocmask(SIG_SETMASK,&old_mask,NULL) == -1){  // Restore the original mask after creaing tasks for consumer threads
         perror("sigprocmask");
         for(int i=0; i<N_THREADS; i++){
@@ -125,6 +353,7 @@ int main(int argc, char **argv) {
 
     memset(&hints,0,sizeof(hints)); // Initialize hints before using it
 
+    memset(&sigact,0,sizeof(sigact));   // No SA_RESTART, accept() must return EINTR for every handled signal
     sigact.sa_handler = handle_sigint;  // Set handler
     if(sigfillset(&sigact.sa_mask) == -1){  // Filling sa_mask field 
         perror("sigfillset");
@@ -134,6 +363,16 @@ int main(int argc, char **argv) {
         perror("sigaction");
         return 1; 
     }
+    sigact.sa_handler = handle_sigusr1;
+    if(sigaction(SIGUSR1, &sigact, NULL) == -1){
+        perror("sigaction");
+        return 1;
+    }
+    sigact.sa_handler = handle_sighup;
+    if(sigaction(SIGHUP, &sigact, NULL) == -1){
+        perror("sigaction");
+        return 1;
+    }
 
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -166,9 +405,12 @@ int main(int argc, char **argv) {
     }
 
     int return_val = 0;
+    int limits_on = rate_limit_enabled(&limiter);
     while(keep_going == 1){
         int client_fd;
-        client_fd = accept(sock_fd,NULL,NULL);
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        client_fd = accept(sock_fd,(struct sockaddr *) &peer,&peer_len);
         if(client_fd == -1){
             if(errno != EINTR){ // The error is occured in accept
                 perror("accept");
@@ -176,10 +418,42 @@ int main(int argc, char **argv) {
                 return_val = 1;
                 break; 
             }
+            else if((dump_stats == 1 || reload_bundle == 1) && keep_going == 1){  // SIGUSR1 or SIGHUP, keep serving afterwards
+                if(dump_stats == 1){
+                    dump_stats = 0;
+                    rate_limit_print_stats(&limiter,stdout);
+                    proxy_print_stats(&proxy,stdout);
+                    if(prewarm_on){
+                        printf("prewarm paths=%d prefetched=%lu\n", prewarm.n_paths, __atomic_load_n(&prewarm.prefetched, __ATOMIC_RELAXED));
+                    }
+                }
+                if(reload_bundle == 1){
+                    reload_bundle = 0;
+                    if(bundle_path != NULL && bundle_store_swap(&bundles,bundle_path) == 0){
+                        printf("Reloaded bundle %s\n", bundle_path);
+                    }
+                }
+                continue;
+            }
             else{   // The error is occured because of arrival of signal
                 break;
             }
         }
+        conn_t *conn = conn_accept(client_fd,(struct sockaddr *) &peer);
+        if(conn == NULL){   // Past the descriptor limit the records were sized for at startup
+            close(client_fd);
+            continue;
+        }
+        TRACE_ACCEPT(conn->id,client_fd);
+        if(limits_on && rate_limit_acquire(&limiter,&conn->limits,(struct sockaddr *) &peer) != RL_ACCEPT){
+            if(!reject_with_close){ // Best effort; a full socket buffer just means the client sees the close
+                reject_connection(client_fd);
+            }
+            TRACE_CLOSE(conn->id,client_fd);
+            close(client_fd);
+            continue;
+        }
+        TRACE_ENQUEUE(conn->id,client_fd);
         if(connection_enqueue(&con_queue,client_fd) == -1){
             printf("Error occured in connection_enqueue\n");
             return_val = 1;
@@ -204,6 +478,28 @@ int main(int argc, char **argv) {
         }
     }
 
+    if(limits_on){
+        rate_limit_print_stats(&limiter,stdout);
+    }
+    rate_limit_free(&limiter);
+    proxy_free(&proxy);
+    if(capture_path != NULL){   // Workers are joined, nothing writes to it any more
+        if(capture_close(&capture) != 0){
+            return_val = 1;
+        }
+        printf("Captured %lu requests to %s\n", capture.records, capture_path);
+    }
+    if(prewarm_on){ // Workers are joined, the table is final
+        if(prewarm_save(&prewarm) != 0){
+            return_val = 1;
+        }
+        prewarm_free(&prewarm);
+    }
+    conn_free();
+    if(bundle_path != NULL){
+        bundle_store_free(&bundles);
+    }
+
     close(sock_fd);
     return return_val;
 }
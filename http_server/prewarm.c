@@ -0,0 +1,325 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "http.h"
+#include "prewarm.h"
+#include "util.h"
+
+// Hash over 'len' bytes, folded to 32 bits
+static uint32_t hash_bytes(const void *data, size_t len) {
+    uint64_t h = fnv1a(FNV1A_INIT, data, len);
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+// Returns the index of a known path or -1. Caller holds the lock.
+static int find_path(prewarm_t *prewarm, const char *name) {
+    uint32_t slot = hash_bytes(name, strlen(name)) & (PREWARM_INDEX_SIZE - 1);
+    while(prewarm->index[slot] != 0){
+        int idx = prewarm->index[slot] - 1;
+        if(strcmp(prewarm->paths[idx].name, name) == 0){
+            return idx;
+        }
+        slot = (slot + 1) & (PREWARM_INDEX_SIZE - 1);
+    }
+    return -1;
+}
+
+// Returns the index of a path, adding it if there is room, or -1. Caller holds the lock.
+static int intern_path(prewarm_t *prewarm, const char *name) {
+    int idx = find_path(prewarm, name);
+    if(idx != -1){
+        return idx;
+    }
+    if(prewarm->n_paths == PREWARM_MAX_PATHS || strlen(name) >= PREWARM_NAME_LEN){
+        return -1;
+    }
+
+    idx = prewarm->n_paths++;
+    prewarm_path_t *path = &prewarm->paths[idx];
+    memset(path,0,sizeof(*path));
+    strcpy(path->name, name);
+    path->last_prefetch = -PREWARM_REFETCH;
+    for(int i=0; i<PREWARM_MAX_NEXT; i++){
+        path->next[i].path = -1;
+    }
+    uint32_t slot = hash_bytes(name, strlen(name)) & (PREWARM_INDEX_SIZE - 1);
+    while(prewarm->index[slot] != 0){
+        slot = (slot + 1) & (PREWARM_INDEX_SIZE - 1);
+    }
+    prewarm->index[slot] = idx + 1;
+    return idx;
+}
+
+// Count one co-access from 'from' to 'to'. Only PREWARM_MAX_NEXT successors fit, so
+// an unseen successor arriving at a full list ages every count down by one instead
+// (Misra-Gries); successors that keep showing up stay, one-offs fall out.
+static void add_edge(prewarm_path_t *from, int to, unsigned count) {
+    for(int i=0; i<PREWARM_MAX_NEXT; i++){
+        if(from->next[i].path == to && from->next[i].count > 0){
+            from->next[i].count += count;
+            return;
+        }
+    }
+    for(int i=0; i<PREWARM_MAX_NEXT; i++){
+        if(from->next[i].count == 0){
+            from->next[i].path = to;
+            from->next[i].count = count;
+            return;
+        }
+    }
+    for(int i=0; i<PREWARM_MAX_NEXT; i++){
+        from->next[i].count--;
+    }
+}
+
+// Start reading a resource into the page cache without waiting for it
+static void prefetch(prewarm_t *prewarm, const char *name, const bundle_t *bundle) {
+    char resource_path[BUFSIZ];
+    if(bundle != NULL){
+        const bundle_entry_t *entry = bundle_lookup(bundle, name);
+        if(entry != NULL){
+            bundle_prefetch(bundle, entry);
+            __atomic_fetch_add(&prewarm->prefetched, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    if(snprintf(resource_path, sizeof(resource_path), "%s%s", prewarm->serve_dir, name) >= sizeof(resource_path)){
+        return;
+    }
+    int fd = open(resource_path, O_RDONLY);
+    if(fd == -1){   // Deleted since it was learned, nothing to warm
+        return;
+    }
+    int result = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    if(result != 0){
+        fprintf(stderr, "posix_fadvise: %s\n", strerror(result));
+    }
+    else{
+        __atomic_fetch_add(&prewarm->prefetched, 1, __ATOMIC_RELAXED);
+    }
+    close(fd);
+}
+
+// Returns the Link relation hinting a resource. Only subresources may be preloaded: a
+// document preloaded as=fetch is never used by the navigation that later asks for it,
+// so the browser would download it twice. Documents get a low-priority prefetch instead.
+static const char *link_rel(const char *name) {
+    const char *mime = get_mime_type_for_path(name);
+    if(mime != NULL && strncmp(mime, "image/", 6) == 0){
+        return "preload; as=image";
+    }
+    return "prefetch";
+}
+
+int prewarm_init(prewarm_t *prewarm, const char *serve_dir, const char *snapshot_path, int link_hints) {
+    int result;
+    memset(prewarm,0,sizeof(*prewarm));
+    prewarm->serve_dir = serve_dir;
+    prewarm->snapshot_path = snapshot_path;
+    prewarm->link_hints = link_hints;
+    for(int i=0; i<PREWARM_CLIENT_SLOTS; i++){
+        prewarm->clients[i].opener = -1;
+    }
+    if((result = pthread_mutex_init(&prewarm->lock,NULL)) != 0){
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(result));
+        return -1;
+    }
+    return 0;
+}
+
+int prewarm_load(prewarm_t *prewarm, const bundle_t *bundle) {
+    char line[2 * PREWARM_NAME_LEN + 64];
+    char name[PREWARM_NAME_LEN], next[PREWARM_NAME_LEN];
+    unsigned long count;
+    int n_prefetched = 0;
+
+    if(prewarm->snapshot_path == NULL){
+        return 0;
+    }
+    FILE *in = fopen(prewarm->snapshot_path, "r");
+    if(in == NULL){
+        if(errno == ENOENT){    // First run, nothing to warm yet
+            return 0;
+        }
+        perror("fopen");
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), in) != NULL){   // Called before the workers start, no locking needed
+        if(sscanf(line, "hot %lu %255s", &count, name) == 2 && name[0] == '/'){
+            int idx = intern_path(prewarm, name);
+            if(idx != -1){
+                prewarm->paths[idx].hits = count;
+                prefetch(prewarm, name, bundle);
+                n_prefetched++;
+            }
+        }
+        else if(sscanf(line, "next %lu %255s %255s", &count, name, next) == 3 && name[0] == '/' && next[0] == '/'){
+            int from = intern_path(prewarm, name);
+            int to = intern_path(prewarm, next);
+            if(from != -1 && to != -1 && from != to){
+                add_edge(&prewarm->paths[from], to, count);
+            }
+        }
+    }
+    fclose(in);
+    return n_prefetched;
+}
+
+void prewarm_request(prewarm_t *prewarm, const char *resource_name, char *link, int link_size, prewarm_plan_t *plan) {
+    char names[PREWARM_MAX_NEXT][PREWARM_NAME_LEN];
+    int n_names = 0;
+    double now = now_seconds();
+
+    plan->n_names = 0;
+    if(link != NULL && link_size > 0){
+        link[0] = '\0';
+    }
+
+    pthread_mutex_lock(&prewarm->lock);
+    int idx = find_path(prewarm, resource_name);
+    if(idx != -1){  // Copy the strong successors out so the formatting happens without the lock
+        prewarm_path_t *path = &prewarm->paths[idx];
+        for(int i=0; i<PREWARM_MAX_NEXT; i++){
+            if(path->next[i].count < PREWARM_MIN_COUNT){
+                continue;
+            }
+            prewarm_path_t *succ = &prewarm->paths[path->next[i].path];
+            strcpy(names[n_names], succ->name);
+            n_names++;
+            if(now - succ->last_prefetch >= PREWARM_REFETCH){
+                strcpy(plan->names[plan->n_names++], succ->name);
+                succ->last_prefetch = now;
+            }
+        }
+    }
+    pthread_mutex_unlock(&prewarm->lock);
+
+    int link_len = 0;
+    for(int i=0; i<n_names && prewarm->link_hints && link != NULL; i++){
+        int len = snprintf(link + link_len, link_size - link_len, "Link: <%s>; rel=%s\r\n", names[i], link_rel(names[i]));
+        if(len >= link_size - link_len){    // Didn't fit, drop the partial line
+            link[link_len] = '\0';
+            break;
+        }
+        link_len += len;
+    }
+}
+
+int prewarm_prefetch(prewarm_t *prewarm, const prewarm_plan_t *plan, const bundle_t *bundle) {
+    for(int i=0; i<plan->n_names; i++){
+        prefetch(prewarm, plan->names[i], bundle);
+    }
+    return plan->n_names;
+}
+
+void prewarm_record(prewarm_t *prewarm, uint32_t client, const char *resource_name, int status) {
+    double now = now_seconds();
+
+    if(status != 200 && status != 304){ // Keep 404s from filling the table
+        return;
+    }
+
+    pthread_mutex_lock(&prewarm->lock);
+    int idx = intern_path(prewarm, resource_name);
+    if(idx != -1){
+        prewarm_client_t *slot = &prewarm->clients[client % PREWARM_CLIENT_SLOTS];
+        prewarm->paths[idx].hits++;
+        if(slot->client != client || slot->opener == -1 || now - slot->opened > PREWARM_WINDOW){   // Open a new window
+            slot->client = client;
+            slot->opener = idx;
+            slot->opened = now;
+            slot->n_credited = 0;
+        }
+        else if(idx != slot->opener){   // Credit each path once per window, e.g. every image of a page to the page
+            int seen = 0;
+            for(int i=0; i<slot->n_credited && !seen; i++){
+                seen = (slot->credited[i] == idx);
+            }
+            if(!seen && slot->n_credited < PREWARM_WINDOW_PATHS){
+                slot->credited[slot->n_credited++] = idx;
+                add_edge(&prewarm->paths[slot->opener], idx, 1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&prewarm->lock);
+}
+
+// qsort comparator putting the most requested paths first
+static int by_hits_desc(const void *a, const void *b) {
+    const unsigned long *x = a, *y = b;
+    return (x[0] < y[0]) - (x[0] > y[0]);
+}
+
+int prewarm_save(prewarm_t *prewarm) {
+    char tmp_path[BUFSIZ];
+    unsigned long (*order)[2];  // {hits, path index} pairs
+
+    if(prewarm->snapshot_path == NULL){
+        return 0;
+    }
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", prewarm->snapshot_path) >= sizeof(tmp_path)){
+        fprintf(stderr, "Snapshot path too long\n");
+        return -1;
+    }
+    if((order = malloc(PREWARM_MAX_PATHS * sizeof(*order))) == NULL){
+        perror("malloc");
+        return -1;
+    }
+    FILE *out = fopen(tmp_path, "w");
+    if(out == NULL){
+        perror("fopen");
+        free(order);
+        return -1;
+    }
+
+    pthread_mutex_lock(&prewarm->lock);
+    for(int i=0; i<prewarm->n_paths; i++){
+        order[i][0] = prewarm->paths[i].hits;
+        order[i][1] = i;
+    }
+    qsort(order, prewarm->n_paths, sizeof(*order), by_hits_desc);
+    int n_hot = (prewarm->n_paths < PREWARM_HOT_SET) ? prewarm->n_paths : PREWARM_HOT_SET;
+    fprintf(out, "# http_server hot set\n");
+    for(int i=0; i<n_hot; i++){
+        prewarm_path_t *path = &prewarm->paths[order[i][1]];
+        fprintf(out, "hot %lu %s\n", path->hits, path->name);
+    }
+    for(int i=0; i<n_hot; i++){ // Successors too, so Link hints work straight after a restart
+        prewarm_path_t *path = &prewarm->paths[order[i][1]];
+        for(int j=0; j<PREWARM_MAX_NEXT; j++){
+            if(path->next[j].count > 0){
+                fprintf(out, "next %u %s %s\n", path->next[j].count, path->name, prewarm->paths[path->next[j].path].name);
+            }
+        }
+    }
+    pthread_mutex_unlock(&prewarm->lock);
+    free(order);
+
+    if(fclose(out) != 0){
+        perror("fclose");
+        unlink(tmp_path);
+        return -1;
+    }
+    if(rename(tmp_path, prewarm->snapshot_path) == -1){  // Never leave a half-written snapshot behind
+        perror("rename");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int prewarm_free(prewarm_t *prewarm) {
+    int result;
+    if((result = pthread_mutex_destroy(&prewarm->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(result));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+#ifndef PREWARM_H
+#define PREWARM_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "bundle.h"
+
+#define PREWARM_MAX_PATHS 1024
+#define PREWARM_INDEX_SIZE 2048     // Power of two, at least twice PREWARM_MAX_PATHS
+#define PREWARM_NAME_LEN 256
+#define PREWARM_MAX_NEXT 4          // Successors tracked per path
+#define PREWARM_CLIENT_SLOTS 1024
+#define PREWARM_WINDOW 5.0          // Seconds after a client's opening request during which its requests count as co-access
+#define PREWARM_WINDOW_PATHS 16     // Distinct paths credited to one opening request per window
+#define PREWARM_MIN_COUNT 2         // Co-accesses seen before a successor is prefetched or hinted
+#define PREWARM_REFETCH 1.0         // Seconds before the same path is prefetched again
+#define PREWARM_HOT_SET 64          // Paths kept in the snapshot
+
+// A successor of a path with its co-access count
+typedef struct {
+    int path;
+    unsigned count;
+} prewarm_edge_t;
+
+// A resource seen by the server
+typedef struct {
+    char name[PREWARM_NAME_LEN];
+    unsigned long hits;
+    prewarm_edge_t next[PREWARM_MAX_NEXT];
+    double last_prefetch;
+} prewarm_path_t;
+
+// Successors picked for a request before its response goes out, prefetched after it
+typedef struct {
+    char names[PREWARM_MAX_NEXT][PREWARM_NAME_LEN];
+    int n_names;
+} prewarm_plan_t;
+
+// A client's current co-access window, slots are shared by hashed client address
+typedef struct {
+    uint32_t client;
+    int opener;                             // Path that opened the window, or -1
+    double opened;
+    int credited[PREWARM_WINDOW_PATHS];     // Paths already counted as following the opener
+    int n_credited;
+} prewarm_client_t;
+
+// Struct representing the learned co-access patterns of the served resources
+typedef struct {
+    pthread_mutex_t lock;
+    prewarm_path_t paths[PREWARM_MAX_PATHS];
+    int n_paths;
+    int index[PREWARM_INDEX_SIZE];  // Path index + 1, or 0 when empty
+    prewarm_client_t clients[PREWARM_CLIENT_SLOTS];
+    const char *serve_dir;
+    const char *snapshot_path;      // NULL when the hot set is not persisted
+    int link_hints;                 // Emit Link: rel=preload/prefetch headers
+    unsigned long prefetched;
+} prewarm_t;
+
+/*
+ * Initialize an empty co-access table.
+ * prewarm: Pointer to prewarm_t to be initialized
+ * serve_dir: Directory files are prefetched from, or NULL when serving a bundle
+ * snapshot_path: File the hot set is loaded from and saved to, or NULL
+ * link_hints: 1 to build Link headers for likely next resources, rel=preload for
+ *   images and rel=prefetch for documents
+ * Returns 0 on success or -1 on error
+ */
+int prewarm_init(prewarm_t *prewarm, const char *serve_dir, const char *snapshot_path, int link_hints);
+
+/*
+ * Load the hot-set snapshot, if one exists, and prefetch every path in it
+ * bundle: The bundle being served, or NULL when serving serve_dir
+ * Returns the number of paths prefetched, or -1 on error
+ */
+int prewarm_load(prewarm_t *prewarm, const bundle_t *bundle);
+
+/*
+ * Look up the resources that usually follow 'resource_name' and, if link hints
+ * are enabled, build the matching Link header lines. Does no I/O, so it can run
+ * before the response; pass 'plan' to prewarm_prefetch() once the response is out.
+ * link: Set to zero or more "Link: ...\r\n" lines, may be NULL
+ * link_size: Size of the 'link' buffer
+ * plan: Set to the resources due to be prefetched
+ */
+void prewarm_request(prewarm_t *prewarm, const char *resource_name, char *link, int link_size, prewarm_plan_t *plan);
+
+/*
+ * Start reading the resources picked by prewarm_request() into the page cache
+ * bundle: The bundle being served, or NULL when serving serve_dir
+ * Returns the number of resources prefetched
+ */
+int prewarm_prefetch(prewarm_t *prewarm, const prewarm_plan_t *plan, const bundle_t *bundle);
+
+/*
+ * Record that a client was served 'resource_name'. A request more than
+ * PREWARM_WINDOW seconds after the client's last opening request opens a new
+ * window; every other request is learned as a successor of the opening one.
+ * Responses other than 200 and 304 are ignored.
+ * client: The hashed peer address from the connection's conn_t
+ * status: The status code of the response sent
+ */
+void prewarm_record(prewarm_t *prewarm, uint32_t client, const char *resource_name, int status);
+
+/*
+ * Write the most requested paths and their successors to the snapshot file
+ * Returns 0 on success or -1 on error
+ */
+int prewarm_save(prewarm_t *prewarm);
+
+/*
+ * Deallocates and cleans up any resources associated with a co-access table.
+ * Returns 0 on success or -1 on error
+ */
+int prewarm_free(prewarm_t *prewarm);
+
+#endif // PREWARM_H
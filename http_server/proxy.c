@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "proxy.h"
+#include "trace.h"
+
+#define REQUEST_SIZE 8192
+#define RESPONSE_HEAD_SIZE 8192
+#define SPLICE_CHUNK 65536
+
+// Each worker keeps one pipe for splicing bodies from upstream to the client
+static __thread int splice_pipe[2] = {-1, -1};
+
+// Client headers that are not passed through: the hop-by-hop headers, which only
+// describe the client's connection, and Host, which build_request() rewrites to
+// the backend's address
+static const char *not_forwarded[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade", "Host", NULL
+};
+
+// Returns 1 if the header line starts with one of the not_forwarded header names
+static int is_not_forwarded(const char *line) {
+    for(int i=0; not_forwarded[i] != NULL; i++){
+        size_t len = strlen(not_forwarded[i]);
+        if(strncasecmp(line,not_forwarded[i],len) == 0 && line[len] == ':'){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Send a bodiless error response to the client
+// sent_status, bytes_sent: Set to what reached the socket, see proxy_forward()
+static int send_error(int fd, int status, const char *reason, int *sent_status, long *bytes_sent) {
+    char buff[128];
+    int len = snprintf(buff, sizeof(buff), "HTTP/1.0 %d %s\r\nContent-Length: 0\r\n\r\n", status, reason);
+    ssize_t written = write(fd,buff,len);
+    if(written == -1){
+        perror("write");
+        return -1;
+    }
+    TRACE_FIRST_BYTE(trace_conn_id);
+    *sent_status = status;
+    *bytes_sent = written;
+    TRACE_RESPONSE_COMPLETE(trace_conn_id,status,written);
+    return 0;
+}
+
+// Write the whole buffer, retrying short writes
+// Returns 0 on success or -1 on error
+static int write_all(int fd, const char *buf, size_t len) {
+    while(len > 0){
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Connect to a backend, giving up after 'connect_timeout_ms'. Reads and writes on
+// the returned socket time out after 'io_timeout_ms'.
+// Returns the connected socket or -1 on error
+static int connect_backend(const proxy_backend_t *backend, int connect_timeout_ms, int io_timeout_ms) {
+    int fd = socket(backend->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1){
+        perror("socket");
+        return -1;
+    }
+    if(connect(fd,(const struct sockaddr *) &backend->addr,backend->addr_len) == -1){
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if(errno != EINPROGRESS || poll(&pfd,1,connect_timeout_ms) != 1
+            || getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&err_len) == -1 || err != 0){
+            close(fd);
+            return -1;
+        }
+    }
+
+    struct timeval tv = {io_timeout_ms / 1000, (io_timeout_ms % 1000) * 1000};
+    int one = 1;
+    if(fcntl(fd,F_SETFL,0) == -1    // Back to blocking, the timeouts below bound every call
+        || setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv)) == -1
+        || setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv)) == -1
+        || setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one)) == -1){
+        perror("setsockopt");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Pick the healthy backend with the fewest outstanding requests and charge it one
+// Returns the backend or NULL if none is healthy
+static proxy_backend_t *pick_backend(proxy_t *proxy, proxy_route_t *route) {
+    proxy_backend_t *best = NULL;
+    pthread_mutex_lock(&proxy->lock);
+    for(int i=0; i<route->n_backends; i++){
+        proxy_backend_t *b = &route->backends[(route->next + i) % route->n_backends];
+        if(b->healthy && (best == NULL || b->outstanding < best->outstanding)){
+            best = b;
+        }
+    }
+    if(best != NULL){
+        best->outstanding++;
+        route->next = (route->next + 1) % route->n_backends;
+    }
+    pthread_mutex_unlock(&proxy->lock);
+    return best;
+}
+
+// Take a pooled connection to the backend, or open a new one if none is usable
+// fresh_only: Skip the pool, used when retrying after a stale pooled connection
+// reused: Set to 1 if the connection came from the pool
+// Returns the connection or -1 on error
+static int take_conn(proxy_t *proxy, proxy_backend_t *backend, int fresh_only, int *reused) {
+    *reused = 0;
+    while(!fresh_only){
+        int fd;
+        pthread_mutex_lock(&proxy->lock);
+        if(backend->n_idle == 0){
+            pthread_mutex_unlock(&proxy->lock);
+            break;
+        }
+        fd = backend->idle_fds[--backend->n_idle];
+        pthread_mutex_unlock(&proxy->lock);
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd,1,0) == 0){    // Nothing to read means the backend has not closed it
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+    }
+    return connect_backend(backend, PROXY_CONNECT_TIMEOUT_MS, proxy->io_timeout_ms);
+}
+
+// Return a connection whose response was fully read to the backend's pool
+static void put_conn(proxy_t *proxy, proxy_backend_t *backend, int fd) {
+    pthread_mutex_lock(&proxy->lock);
+    if(backend->n_idle < PROXY_POOL_SIZE && !proxy->stopping){
+        backend->idle_fds[backend->n_idle++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&proxy->lock);
+    if(fd != -1){
+        close(fd);
+    }
+}
+
+// Build the upstream request, passing through the client's end-to-end headers
+// Returns the request length, or -1 if it does not fit
+static int build_request(char *buf, int size, const proxy_backend_t *backend, const char *resource_name, const char *head) {
+    int len = snprintf(buf, size, "GET %s HTTP/1.0\r\nHost: %s:%s\r\nConnection: keep-alive\r\n",
+        resource_name, backend->host, backend->port);
+    if(len >= size){
+        return -1;
+    }
+
+    const char *line = (head != NULL) ? strchr(head,'\n') : NULL;  // Skip the request line
+    while(line != NULL){
+        line++;
+        const char *end = strchr(line,'\n');
+        if(end == NULL || *line == '\r' || *line == '\n'){  // End of headers, or a line cut off by truncation
+            break;
+        }
+        int line_len = end - line + 1;
+        if(!is_not_forwarded(line)){
+            if(len + line_len >= size){
+                return -1;
+            }
+            memcpy(buf + len, line, line_len);
+            len += line_len;
+        }
+        line = end;
+    }
+
+    if(len + 2 >= size){
+        return -1;
+    }
+    memcpy(buf + len, "\r\n", 2);
+    return len + 2;
+}
+
+// Read from the backend until the end of the response headers
+// head_end: Set to the length of the headers including the blank line
+// Returns the number of bytes read, 0 if the backend closed before sending
+// anything, or -1 on error
+static int read_response_head(int fd, char *buf, int size, int *head_end) {
+    int len = 0;
+    while(len < size - 1){
+        ssize_t n = recv(fd, buf + len, size - 1 - len, 0);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0){
+            if(len == 0){
+                return 0;
+            }
+            errno = ECONNRESET;
+            return -1;
+        }
+        len += n;
+        buf[len] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        if(end != NULL){
+            *head_end = end - buf + 4;
+            return len;
+        }
+    }
+    errno = EMSGSIZE;
+    return -1;
+}
+
+// Move up to 'remaining' bytes (or everything until EOF when negative) from the
+// backend to the client through the worker's pipe, without copying into user space
+// Returns 0 on success or -1 on error
+static int splice_body(int up_fd, int client_fd, long remaining, long *moved) {
+    if(splice_pipe[0] == -1 && pipe2(splice_pipe, O_CLOEXEC) == -1){
+        perror("pipe2");
+        return -1;
+    }
+
+    while(remaining != 0){
+        size_t want = (remaining < 0 || remaining > SPLICE_CHUNK) ? SPLICE_CHUNK : remaining;
+        ssize_t in = splice(up_fd, NULL, splice_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in == 0){    // Backend closed the connection
+            return (remaining < 0) ? 0 : -1;
+        }
+        if(in == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("splice");
+            return -1;
+        }
+        while(in > 0){
+            ssize_t out = splice(splice_pipe[0], NULL, client_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(out == -1 && errno == EINTR){
+                continue;
+            }
+            if(out <= 0){   // Bytes may be stranded in the pipe, start the next request with a fresh one
+                perror("splice");
+                close(splice_pipe[0]);
+                close(splice_pipe[1]);
+                splice_pipe[0] = splice_pipe[1] = -1;
+                return -1;
+            }
+            in -= out;
+            *moved += out;
+            if(remaining > 0){
+                remaining -= out;
+            }
+        }
+    }
+    return 0;
+}
+
+// Forward the backend's response headers to the client with connection-level headers
+// replaced, and work out how the body is delimited
+// content_length: Set to the body length, or -1 if it runs until the backend closes
+// keep_alive: Set to 1 if the backend will keep the connection open afterwards
+// Returns the number of bytes written, -2 if the backend's head is not an HTTP
+// response (nothing is written then), or -1 if writing to the client failed
+static int relay_head(int client_fd, char *buf, int head_end, long *content_length, int *keep_alive, int *status) {
+    char out[RESPONSE_HEAD_SIZE + 64];
+    int out_len = 0;
+    int http11 = 0;
+    int conn_close = 0;
+    int conn_keep = 0;
+    char *sp;
+
+    buf[head_end - 2] = '\0';   // Terminate after the last header line
+    if(strncmp(buf,"HTTP/1.",7) != 0 || (sp = strchr(buf,' ')) == NULL){
+        return -2;
+    }
+    http11 = (buf[7] == '1');
+    *status = atoi(sp + 1);
+    *content_length = -1;
+    char *line_end = strstr(buf,"\r\n");
+    out_len = snprintf(out, sizeof(out), "HTTP/1.0%.*s\r\n", (int) (line_end - sp), sp);   // Client spoke HTTP/1.0
+
+    for(char *line = line_end + 2; *line != '\0'; line = line_end + 2){
+        line_end = strstr(line,"\r\n");
+        *line_end = '\0';
+        if(strncasecmp(line,"Content-Length:",15) == 0){
+            *content_length = atol(line + 15);
+        }
+        if(strncasecmp(line,"Connection:",11) == 0){
+            conn_close = (strcasestr(line,"close") != NULL);
+            conn_keep = (strcasestr(line,"keep-alive") != NULL);
+        }
+        if(strncasecmp(line,"Transfer-Encoding:",18) == 0){
+            *content_length = -1;
+            conn_close = 1;
+        }
+        if(strncasecmp(line,"Connection:",11) != 0 && strncasecmp(line,"Keep-Alive:",11) != 0){
+            out_len += snprintf(out + out_len, sizeof(out) - out_len, "%s\r\n", line);
+        }
+    }
+    out_len += snprintf(out + out_len, sizeof(out) - out_len, "Connection: close\r\n\r\n");
+
+    if(*status == 204 || *status == 304 || *status / 100 == 1){  // Never carry a body
+        *content_length = 0;
+    }
+    *keep_alive = *content_length >= 0 && !conn_close && (http11 || conn_keep);
+
+    if(write_all(client_fd, out, out_len) == -1){
+        perror("write");
+        return -1;
+    }
+    return out_len;
+}
+
+int proxy_forward(proxy_t *proxy, proxy_route_t *route, int client_fd, const char *resource_name, const char *head,
+    int *sent_status, long *bytes_sent) {
+    char request[REQUEST_SIZE];
+    char response[RESPONSE_HEAD_SIZE];
+    int request_len, response_len = -1, head_end = 0;
+    int up_fd = -1, reused = 0;
+    int return_val = 0;
+
+    *sent_status = 0;
+    *bytes_sent = 0;
+    proxy_backend_t *backend = pick_backend(proxy, route);
+    if(backend == NULL){
+        return send_error(client_fd, 503, "Service Unavailable", sent_status, bytes_sent);
+    }
+    if((request_len = build_request(request, sizeof(request), backend, resource_name, head)) == -1){
+        return_val = send_error(client_fd, 431, "Request Header Fields Too Large", sent_status, bytes_sent);
+        goto done;
+    }
+
+    for(int attempt=0; attempt<2; attempt++){   // A pooled connection may have gone stale, retry once on a fresh one
+        if((up_fd = take_conn(proxy, backend, attempt > 0, &reused)) == -1){
+            pthread_mutex_lock(&proxy->lock);
+            backend->healthy = 0;   // Stop routing here until the health checker sees it come back
+            pthread_mutex_unlock(&proxy->lock);
+            break;
+        }
+        if(write_all(up_fd, request, request_len) == 0
+            && (response_len = read_response_head(up_fd, response, sizeof(response), &head_end)) > 0){
+            break;
+        }
+        int timed_out = (response_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+        close(up_fd);
+        up_fd = -1;
+        if(timed_out || !reused){
+            response_len = timed_out ? -2 : -1;
+            break;
+        }
+    }
+
+    if(up_fd == -1){
+        __atomic_fetch_add(&backend->failed, 1, __ATOMIC_RELAXED);
+        if(response_len == -2){
+            return_val = send_error(client_fd, 504, "Gateway Timeout", sent_status, bytes_sent);
+        }
+        else{
+            return_val = send_error(client_fd, 502, "Bad Gateway", sent_status, bytes_sent);
+        }
+        goto done;
+    }
+
+    long content_length, moved = 0;
+    int keep_alive, status, head_len;
+    if((head_len = relay_head(client_fd, response, head_end, &content_length, &keep_alive, &status)) < 0){
+        close(up_fd);
+        if(head_len == -2){ // The client has not been sent anything yet
+            __atomic_fetch_add(&backend->failed, 1, __ATOMIC_RELAXED);
+            return_val = send_error(client_fd, 502, "Bad Gateway", sent_status, bytes_sent);
+        }
+        else{
+            return_val = -1;
+        }
+        goto done;
+    }
+    TRACE_FIRST_BYTE(trace_conn_id);
+    *sent_status = status;
+    *bytes_sent = head_len;
+
+    // Body bytes that arrived together with the headers
+    long extra = response_len - head_end;
+    if(content_length >= 0 && extra > content_length){  // More than announced, don't trust the connection again
+        extra = content_length;
+        keep_alive = 0;
+    }
+    if(extra > 0 && write_all(client_fd, response + head_end, extra) == -1){
+        perror("write");
+        close(up_fd);
+        return_val = -1;
+        goto done;
+    }
+    moved = extra;
+
+    int spliced = splice_body(up_fd, client_fd, content_length >= 0 ? content_length - extra : -1, &moved);
+    *bytes_sent = head_len + moved;
+    if(spliced == -1){
+        close(up_fd);
+        return_val = -1;
+        goto done;
+    }
+    if(keep_alive){
+        put_conn(proxy, backend, up_fd);
+    }
+    else{
+        close(up_fd);
+    }
+    __atomic_fetch_add(&backend->forwarded, 1, __ATOMIC_RELAXED);
+    TRACE_RESPONSE_COMPLETE(trace_conn_id,status,head_len + moved);
+
+done:
+    pthread_mutex_lock(&proxy->lock);
+    backend->outstanding--;
+    pthread_mutex_unlock(&proxy->lock);
+    return return_val;
+}
+
+// Health check thread: try to connect to every backend every PROXY_HEALTH_INTERVAL seconds
+static void *health_thread_func(void *arg) {
+    proxy_t *proxy = (proxy_t *) arg;
+
+    while(1){
+        for(int r=0; r<proxy->n_routes; r++){
+            for(int i=0; i<proxy->routes[r].n_backends; i++){
+                proxy_backend_t *b = &proxy->routes[r].backends[i];
+                int fd = connect_backend(b, PROXY_CONNECT_TIMEOUT_MS, PROXY_CONNECT_TIMEOUT_MS);
+                int up = (fd != -1);
+                if(fd != -1){
+                    close(fd);
+                }
+                pthread_mutex_lock(&proxy->lock);
+                if(b->healthy != up){
+                    printf("Backend %s:%s for %s is %s\n", b->host, b->port, proxy->routes[r].prefix, up ? "up" : "down");
+                }
+                b->healthy = up;
+                pthread_mutex_unlock(&proxy->lock);
+            }
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += PROXY_HEALTH_INTERVAL;
+        pthread_mutex_lock(&proxy->lock);
+        while(!proxy->stopping && pthread_cond_timedwait(&proxy->stop, &proxy->lock, &deadline) != ETIMEDOUT){
+            continue;
+        }
+        int stopping = proxy->stopping;
+        pthread_mutex_unlock(&proxy->lock);
+        if(stopping){
+            break;
+        }
+    }
+    return NULL;
+}
+
+int proxy_init(proxy_t *proxy) {
+    int result;
+    memset(proxy,0,sizeof(*proxy));
+    proxy->io_timeout_ms = PROXY_IO_TIMEOUT_MS;
+    if((result = pthread_mutex_init(&proxy->lock,NULL)) != 0){
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(result));
+        return -1;
+    }
+    if((result = pthread_cond_init(&proxy->stop,NULL)) != 0){
+        fprintf(stderr, "pthread_cond_init: %s\n", strerror(result));
+        pthread_mutex_destroy(&proxy->lock);
+        return -1;
+    }
+    return 0;
+}
+
+int proxy_add_route(proxy_t *proxy, const char *spec) {
+    char copy[1024];
+    char *save;
+    const char *eq = strchr(spec,'=');
+
+    if(proxy->n_routes == PROXY_MAX_ROUTES){
+        fprintf(stderr, "Too many proxy routes\n");
+        return -1;
+    }
+    if(spec[0] != '/' || eq == NULL || eq - spec >= PROXY_PREFIX_LEN || strlen(eq + 1) >= sizeof(copy)){
+        fprintf(stderr, "Invalid proxy route '%s', expected PREFIX=HOST:PORT[,HOST:PORT...]\n", spec);
+        return -1;
+    }
+
+    proxy_route_t *route = &proxy->routes[proxy->n_routes];
+    memset(route,0,sizeof(*route));
+    route->prefix_len = eq - spec;
+    memcpy(route->prefix, spec, route->prefix_len);
+    strcpy(copy, eq + 1);
+
+    for(char *tok = strtok_r(copy,",",&save); tok != NULL; tok = strtok_r(NULL,",",&save)){
+        char *colon = strrchr(tok,':');
+        if(route->n_backends == PROXY_MAX_BACKENDS){
+            fprintf(stderr, "Too many backends for %s\n", route->prefix);
+            return -1;
+        }
+        proxy_backend_t *b = &route->backends[route->n_backends];
+        if(colon == NULL || colon - tok >= sizeof(b->host) || strlen(colon + 1) >= sizeof(b->port)){
+            fprintf(stderr, "Invalid backend '%s'\n", tok);
+            return -1;
+        }
+        *colon = '\0';
+        if(tok[0] == '[' && colon[-1] == ']'){  // Bracketed IPv6 literal
+            colon[-1] = '\0';
+            tok++;
+        }
+        strcpy(b->host, tok);
+        strcpy(b->port, colon + 1);
+
+        struct addrinfo hints, *res;
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int retval = getaddrinfo(b->host,b->port,&hints,&res);
+        if(retval != 0){
+            fprintf(stderr, "getaddrinfo %s:%s failed: %s\n", b->host, b->port, gai_strerror(retval));
+            return -1;
+        }
+        memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+        b->addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+        b->healthy = 1; // Until the first health check says otherwise
+        route->n_backends++;
+    }
+    if(route->n_backends == 0){
+        fprintf(stderr, "No backends given for %s\n", route->prefix);
+        return -1;
+    }
+    proxy->n_routes++;
+    return 0;
+}
+
+int proxy_start(proxy_t *proxy) {
+    int result;
+    if(proxy->n_routes == 0){
+        return 0;
+    }
+    if((result = pthread_create(&proxy->health_thread,NULL,health_thread_func,proxy)) != 0){
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        return -1;
+    }
+    proxy->health_started = 1;
+    return 0;
+}
+
+proxy_route_t *proxy_match(proxy_t *proxy, const char *resource_name) {
+    proxy_route_t *best = NULL;
+    for(int i=0; i<proxy->n_routes; i++){
+        proxy_route_t *route = &proxy->routes[i];
+        if(strncmp(resource_name,route->prefix,route->prefix_len) != 0){
+            continue;
+        }
+        char next = resource_name[route->prefix_len];   // In bounds now, the prefix matched up to here
+        if((route->prefix[route->prefix_len - 1] == '/' || next == '\0' || next == '/' || next == '?')   // Match whole path segments only
+            && (best == NULL || route->prefix_len > best->prefix_len)){
+            best = route;
+        }
+    }
+    return best;
+}
+
+void proxy_print_stats(proxy_t *proxy, FILE *out) {
+    pthread_mutex_lock(&proxy->lock);
+    for(int r=0; r<proxy->n_routes; r++){
+        for(int i=0; i<proxy->routes[r].n_backends; i++){
+            proxy_backend_t *b = &proxy->routes[r].backends[i];
+            fprintf(out, "proxy %s %s:%s healthy=%d outstanding=%d idle=%d forwarded=%lu failed=%lu\n",
+                proxy->routes[r].prefix, b->host, b->port, b->healthy, b->outstanding, b->n_idle,
+                __atomic_load_n(&b->forwarded, __ATOMIC_RELAXED), __atomic_load_n(&b->failed, __ATOMIC_RELAXED));
+        }
+    }
+    pthread_mutex_unlock(&proxy->lock);
+    fflush(out);
+}
+
+int proxy_free(proxy_t *proxy) {
+    int return_val = 0;
+    int result;
+
+    pthread_mutex_lock(&proxy->lock);
+    proxy->stopping = 1;
+    pthread_cond_broadcast(&proxy->stop);   // Wake the health checker out of its sleep
+    pthread_mutex_unlock(&proxy->lock);
+    if(proxy->health_started && (result = pthread_join(proxy->health_thread,NULL)) != 0){
+        fprintf(stderr, "pthread_join: %s\n", strerror(result));
+        return_val = -1;
+    }
+
+    for(int r=0; r<proxy->n_routes; r++){   // Close every pooled connection
+        for(int i=0; i<proxy->routes[r].n_backends; i++){
+            proxy_backend_t *b = &proxy->routes[r].backends[i];
+            while(b->n_idle > 0){
+                close(b->idle_fds[--b->n_idle]);
+            }
+        }
+    }
+    pthread_cond_destroy(&proxy->stop);
+    pthread_mutex_destroy(&proxy->lock);
+    return return_val;
+}
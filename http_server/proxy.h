@@ -0,0 +1,106 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define PROXY_MAX_ROUTES 16
+#define PROXY_MAX_BACKENDS 8        // Per route
+#define PROXY_POOL_SIZE 8           // Idle keep-alive connections kept per backend
+#define PROXY_PREFIX_LEN 256
+#define PROXY_HEALTH_INTERVAL 2     // Seconds between health checks
+#define PROXY_CONNECT_TIMEOUT_MS 1000
+#define PROXY_IO_TIMEOUT_MS 10000
+
+// One upstream server. Everything but the address is protected by the proxy's lock.
+typedef struct {
+    char host[64];
+    char port[8];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int healthy;
+    int outstanding;                // Requests currently being forwarded to it
+    int idle_fds[PROXY_POOL_SIZE];  // Connections ready to be reused
+    int n_idle;
+    unsigned long forwarded;
+    unsigned long failed;
+} proxy_backend_t;
+
+// Requests whose path starts with 'prefix' are spread over 'backends'
+typedef struct {
+    char prefix[PROXY_PREFIX_LEN];
+    int prefix_len;
+    proxy_backend_t backends[PROXY_MAX_BACKENDS];
+    int n_backends;
+    int next;   // Where the least-outstanding scan starts, so ties rotate between backends
+} proxy_route_t;
+
+// Struct representing the reverse proxy configuration and its connection pools
+typedef struct {
+    proxy_route_t routes[PROXY_MAX_ROUTES];
+    int n_routes;
+    int io_timeout_ms;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    pthread_t health_thread;
+    int health_started;
+} proxy_t;
+
+/*
+ * Initialize a proxy with no routes.
+ * proxy: Pointer to proxy_t to be initialized
+ * Returns 0 on success or -1 on error
+ */
+int proxy_init(proxy_t *proxy);
+
+/*
+ * Add a route from a "PREFIX=HOST:PORT[,HOST:PORT...]" specification,
+ * e.g. "/api=127.0.0.1:9000,127.0.0.1:9001". Backend addresses are resolved now.
+ * proxy: A pointer to the proxy_t to add to
+ * spec: The route specification
+ * Returns 0 on success or -1 on error
+ */
+int proxy_add_route(proxy_t *proxy, const char *spec);
+
+/*
+ * Start the thread that periodically health checks every backend
+ * Returns 0 on success or -1 on error
+ */
+int proxy_start(proxy_t *proxy);
+
+/*
+ * Find the route with the longest prefix matching a resource name
+ * Returns the route, or NULL if the request should be served locally
+ */
+proxy_route_t *proxy_match(proxy_t *proxy, const char *resource_name);
+
+/*
+ * Forward a request to the least loaded healthy backend of a route and stream
+ * the response back to the client. Errors before the response starts are
+ * reported to the client as 502, 503 or 504.
+ * proxy: A pointer to the proxy_t
+ * route: The route returned by proxy_match()
+ * client_fd: The client socket's file descriptor
+ * resource_name: The requested resource name, forwarded as is
+ * head: The raw request from read_http_request_head(), or NULL
+ * status: Set to the status code sent to the client, or 0 if nothing was sent
+ * bytes_sent: Set to the number of bytes written to the client, also on error
+ * Returns 0 on success or -1 on error
+ */
+int proxy_forward(proxy_t *proxy, proxy_route_t *route, int client_fd, const char *resource_name, const char *head,
+    int *status, long *bytes_sent);
+
+/*
+ * Write each backend's health, load and counters to a stream
+ */
+void proxy_print_stats(proxy_t *proxy, FILE *out);
+
+/*
+ * Stops the health check thread and closes every pooled connection.
+ * Returns 0 on success or -1 on error
+ */
+int proxy_free(proxy_t *proxy);
+
+#endif // PROXY_H
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LISTEN_QUEUE_LEN 64
+#define REQUEST_SIZE 8192
+
+// Stand-in backend for exercising the reverse proxy. Every response body names
+// the backend's port, the connection number and the request number on that
+// connection, so pooling and balancing can be checked from the client side.
+
+static const char *port = NULL;
+static int delay_ms = 0;
+static int bad_head = 0;
+static int close_after = 0;
+static int n_conns = 0;
+
+// Read one request head. Returns 1 if a head was read, 0 if the peer closed, -1 on error
+static int read_head(int fd, char *buf, int size) {
+    int len = 0;
+    while(len < size - 1){
+        ssize_t n = read(fd, buf + len, size - 1 - len);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0){
+            return 0;
+        }
+        len += n;
+        buf[len] = '\0';
+        if(strstr(buf,"\r\n\r\n") != NULL){
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Serve requests on one connection until the proxy closes it
+static void *conn_thread_func(void *arg) {
+    int fd = (int) (long) arg;
+    int conn = __atomic_add_fetch(&n_conns, 1, __ATOMIC_RELAXED);
+    char request[REQUEST_SIZE];
+    char response[512];
+    char body[128];
+
+    for(int served=1; read_head(fd, request, sizeof(request)) == 1; served++){
+        if(delay_ms > 0){
+            struct timespec ts = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+        int body_len = snprintf(body, sizeof(body), "port %s conn %d request %d\n", port, conn, served);
+        int len;
+        if(bad_head){
+            len = snprintf(response, sizeof(response), "NOT-HTTP garbage\r\n\r\n");
+        }
+        else{
+            len = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n%s\r\n%s",
+                body_len, close_after ? "Connection: close\r\n" : "", body);
+        }
+        if(send(fd, response, len, MSG_NOSIGNAL) == -1 || close_after || bad_head){
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "d:bc")) != -1){
+        switch(opt){
+            case 'd': delay_ms = atoi(optarg); break;
+            case 'b': bad_head = 1; break;
+            case 'c': close_after = 1; break;
+            default: optind = argc + 1; break;
+        }
+    }
+    if(argc - optind != 1){
+        printf("Usage: %s [-d delay_ms] [-b] [-c] <port>\n", argv[0]);
+        printf("  -d delay_ms  wait this long before answering each request\n");
+        printf("  -b           answer with a malformed response head\n");
+        printf("  -c           close the connection after each response instead of keeping it alive\n");
+        return 1;
+    }
+    port = argv[optind];
+
+    struct addrinfo hints;
+    struct addrinfo *server;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int retval = getaddrinfo(NULL, port, &hints, &server);
+    if(retval != 0){
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(retval));
+        return 1;
+    }
+    int sock_fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+    if(sock_fd == -1){
+        perror("socket");
+        freeaddrinfo(server);
+        return 1;
+    }
+    int on = 1;
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(sock_fd, server->ai_addr, server->ai_addrlen) == -1){
+        perror("bind");
+        freeaddrinfo(server);
+        close(sock_fd);
+        return 1;
+    }
+    freeaddrinfo(server);
+    if(listen(sock_fd, LISTEN_QUEUE_LEN) == -1){
+        perror("listen");
+        close(sock_fd);
+        return 1;
+    }
+
+    while(1){
+        int client_fd = accept(sock_fd, NULL, NULL);
+        if(client_fd == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, conn_thread_func, (void *) (long) client_fd) != 0){
+            fprintf(stderr, "pthread_create failed\n");
+            close(client_fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(sock_fd);
+    return 1;
+}
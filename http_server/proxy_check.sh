@@ -0,0 +1,74 @@
+#!/bin/sh
+# Exercise the reverse proxy against stand-in backends: connection pooling,
+# 502/503/504 answers and least-outstanding balancing.
+# Usage: ./proxy_check.sh [base port]   (uses the base port and the next 5)
+
+base=${1:-8000}
+fast=$((base + 1))
+slow=$((base + 2))
+stuck=$((base + 3))
+bad=$((base + 4))
+dead=$((base + 5))
+failures=0
+pids=""
+
+cleanup() {
+    kill $pids 2>/dev/null
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+check() {   # check <description> <expected> <actual>
+    if [ "$2" = "$3" ]; then
+        echo "PASS $1"
+    else
+        echo "FAIL $1: expected '$2', got '$3'"
+        failures=$((failures + 1))
+    fi
+}
+
+status() {
+    curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$base$1"
+}
+
+./proxy_backend $fast & pids="$pids $!"
+./proxy_backend -d 300 $slow & pids="$pids $!"
+./proxy_backend -d 3000 $stuck & pids="$pids $!"
+./proxy_backend -b $bad & pids="$pids $!"
+./proxy_backend $dead & dead_pid=$!
+sleep 0.5
+./http_server -T 1000 \
+    -P /pool=127.0.0.1:$fast \
+    -P /lb=127.0.0.1:$fast,127.0.0.1:$slow \
+    -P /stuck=127.0.0.1:$stuck \
+    -P /bad=127.0.0.1:$bad \
+    -P /dead=127.0.0.1:$dead \
+    server_files $base >/dev/null & pids="$pids $!"
+sleep 0.5
+
+# Pooling: the second request reuses the first request's backend connection
+first=$(curl -s "http://127.0.0.1:$base/pool/a" | cut -d' ' -f4)
+second=$(curl -s "http://127.0.0.1:$base/pool/b" | cut -d' ' -f4-)
+check "pooled connection reused" "$first request 2" "$second"
+
+check "malformed backend head answers 502" 502 "$(status /bad/x)"
+# Stop a backend the health checker has seen up: the first request fails to connect
+kill $dead_pid
+wait $dead_pid 2>/dev/null
+check "unreachable backend answers 502" 502 "$(status /dead/x)"
+check "backend marked down answers 503" 503 "$(status /dead/x)"
+check "backend timeout answers 504" 504 "$(status /stuck/x)"
+
+# Least outstanding: while the slow backend holds a request, the rest go to the fast one
+out=$(mktemp)
+curls=""
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    curl -s "http://127.0.0.1:$base/lb/$i" >>"$out" & curls="$curls $!"
+done
+wait $curls
+n_fast=$(grep -c "^port $fast " "$out")
+n_slow=$(grep -c "^port $slow " "$out")
+rm -f "$out"
+check "least outstanding prefers the free backend" yes "$([ "$n_fast" -gt "$n_slow" ] && [ $((n_fast + n_slow)) -eq 10 ] && echo yes || echo "no ($n_fast fast, $n_slow slow)")"
+
+[ $failures -eq 0 ]
@@ -0,0 +1,276 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rate_limit.h"
+#include "util.h"
+
+#define CHARGE_OK 0
+#define CHARGE_CONN 1
+#define CHARGE_RATE 2
+
+static const char *reject_names[] = {
+    "accepted", "conn_ip", "conn_prefix", "rate_ip", "rate_prefix"
+};
+
+// Build the key for 'addr' with every bit past 'prefix_len' cleared
+// Returns 0 on success or -1 if the address family is not supported
+static int make_key(rl_key_t *key, const struct sockaddr *addr, int ipv4_prefix, int ipv6_prefix) {
+    const uint8_t *bytes;
+    int len;
+    memset(key,0,sizeof(*key));
+
+    if(addr->sa_family == AF_INET){
+        bytes = (const uint8_t *) &((const struct sockaddr_in *) addr)->sin_addr;
+        len = 4;
+        key->prefix_len = ipv4_prefix;
+    }
+    else if(addr->sa_family == AF_INET6){
+        const struct in6_addr *a6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+        if(IN6_IS_ADDR_V4MAPPED(a6)){   // Treat IPv4 clients of a dual-stack socket as IPv4
+            bytes = a6->s6_addr + 12;
+            len = 4;
+            key->prefix_len = ipv4_prefix;
+        }
+        else{
+            bytes = a6->s6_addr;
+            len = 16;
+            key->prefix_len = ipv6_prefix;
+        }
+    }
+    else{
+        return -1;
+    }
+    key->family = (len == 4) ? AF_INET : AF_INET6;
+
+    for(int i=0; i<len; i++){   // Copy whole bytes inside the prefix, mask the partial one, leave the rest zero
+        int bits = key->prefix_len - i * 8;
+        if(bits >= 8){
+            key->addr[i] = bytes[i];
+        }
+        else if(bits > 0){
+            key->addr[i] = bytes[i] & (uint8_t) (0xff << (8 - bits));
+        }
+    }
+    return 0;
+}
+
+// Hash over the key bytes, folded so the stripe and bucket picks see the high bits too
+static uint32_t hash_key(const rl_key_t *key) {
+    uint64_t h = fnv1a(FNV1A_INIT, key, sizeof(*key));
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+// Remove idle entries from one bucket chain. Caller holds the stripe lock.
+static void sweep_chain(rl_entry_t **head, double now) {
+    rl_entry_t **link = head;
+    while(*link != NULL){
+        rl_entry_t *entry = *link;
+        if(entry->active == 0 && now - entry->last_seen > RL_ENTRY_TTL){
+            *link = entry->next;
+            free(entry);
+        }
+        else{
+            link = &entry->next;
+        }
+    }
+}
+
+// Charge one connection against the entry for 'key', creating it if needed
+// Returns CHARGE_OK if admitted, or CHARGE_CONN / CHARGE_RATE naming the limit that was hit
+static int charge(rate_limiter_t *limiter, const rl_key_t *key, int max_conns, double rate, double burst, double now) {
+    uint32_t h = hash_key(key);
+    rl_stripe_t *stripe = &limiter->stripes[h % RL_NUM_STRIPES];
+    rl_entry_t **head = &stripe->buckets[(h / RL_NUM_STRIPES) % RL_BUCKETS_PER_STRIPE];
+    int outcome = CHARGE_OK;
+    int result;
+
+    if(burst < 1){
+        burst = 1;
+    }
+    if((result = pthread_mutex_lock(&stripe->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(result));
+        return CHARGE_OK;   // Fail open rather than refuse every client
+    }
+
+    sweep_chain(head, now);
+    sweep_chain(&stripe->buckets[stripe->sweep_idx], now);  // Age out one more bucket per call so unvisited chains don't grow forever
+    stripe->sweep_idx = (stripe->sweep_idx + 1) % RL_BUCKETS_PER_STRIPE;
+
+    rl_entry_t *entry = *head;
+    while(entry != NULL && memcmp(&entry->key, key, sizeof(*key)) != 0){
+        entry = entry->next;
+    }
+    if(entry == NULL){
+        if((entry = calloc(1, sizeof(*entry))) == NULL){
+            perror("calloc");
+            pthread_mutex_unlock(&stripe->lock);
+            return CHARGE_OK;
+        }
+        entry->key = *key;
+        entry->tokens = burst;
+        entry->last_refill = now;
+        entry->next = *head;
+        *head = entry;
+    }
+    entry->last_seen = now;
+
+    if(rate > 0){   // Refill the bucket for the time elapsed since the last charge
+        entry->tokens += (now - entry->last_refill) * rate;
+        if(entry->tokens > burst){
+            entry->tokens = burst;
+        }
+        entry->last_refill = now;
+    }
+
+    if(max_conns > 0 && entry->active >= max_conns){
+        outcome = CHARGE_CONN;
+    }
+    else if(rate > 0 && entry->tokens < 1){
+        outcome = CHARGE_RATE;
+    }
+    else{
+        entry->active++;
+        if(rate > 0){
+            entry->tokens -= 1;
+        }
+    }
+
+    if((result = pthread_mutex_unlock(&stripe->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(result));
+    }
+    return outcome;
+}
+
+// Undo a successful charge(). 'refund' also returns the consumed token.
+static void uncharge(rate_limiter_t *limiter, const rl_key_t *key, int refund, double rate, double burst) {
+    uint32_t h = hash_key(key);
+    rl_stripe_t *stripe = &limiter->stripes[h % RL_NUM_STRIPES];
+    rl_entry_t *entry = stripe->buckets[(h / RL_NUM_STRIPES) % RL_BUCKETS_PER_STRIPE];
+    int result;
+
+    if((result = pthread_mutex_lock(&stripe->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(result));
+        return;
+    }
+    while(entry != NULL && memcmp(&entry->key, key, sizeof(*key)) != 0){
+        entry = entry->next;
+    }
+    if(entry != NULL){
+        if(entry->active > 0){
+            entry->active--;
+        }
+        if(refund && rate > 0 && entry->tokens + 1 <= (burst < 1 ? 1 : burst)){
+            entry->tokens += 1;
+        }
+        entry->last_seen = now_seconds();
+    }
+    if((result = pthread_mutex_unlock(&stripe->lock)) != 0){
+        fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(result));
+    }
+}
+
+int rate_limit_init(rate_limiter_t *limiter, const rate_limit_config_t *config) {
+    int result;
+
+    memset(limiter,0,sizeof(*limiter));
+    limiter->config = *config;
+
+    for(int i=0; i<RL_NUM_STRIPES; i++){
+        if((result = pthread_mutex_init(&limiter->stripes[i].lock,NULL)) != 0){
+            fprintf(stderr, "pthread_mutex_init: %s\n", strerror(result));
+            for(int j=0; j<i; j++){
+                pthread_mutex_destroy(&limiter->stripes[j].lock);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rate_limit_enabled(const rate_limiter_t *limiter) {
+    const rate_limit_config_t *c = &limiter->config;
+    return c->max_conns_ip > 0 || c->max_conns_prefix > 0 || c->rate_ip > 0 || c->rate_prefix > 0;
+}
+
+int rate_limit_acquire(rate_limiter_t *limiter, rl_hold_t *hold, const struct sockaddr *addr) {
+    const rate_limit_config_t *c = &limiter->config;
+    int use_ip = c->max_conns_ip > 0 || c->rate_ip > 0;
+    int use_prefix = c->max_conns_prefix > 0 || c->rate_prefix > 0;
+    rl_key_t ip_key, prefix_key;
+    double now = now_seconds();
+    int outcome;
+
+    hold->held = 0;
+    if(make_key(&ip_key, addr, 32, 128) == -1){    // Nothing to key on, let it through
+        __atomic_fetch_add(&limiter->accepted, 1, __ATOMIC_RELAXED);
+        return RL_ACCEPT;
+    }
+    make_key(&prefix_key, addr, RL_IPV4_PREFIX, RL_IPV6_PREFIX);
+
+    if(use_ip && (outcome = charge(limiter, &ip_key, c->max_conns_ip, c->rate_ip, c->burst_ip, now)) != CHARGE_OK){
+        outcome = (outcome == CHARGE_CONN) ? RL_REJECT_CONN_IP : RL_REJECT_RATE_IP;
+        __atomic_fetch_add(&limiter->rejected[outcome], 1, __ATOMIC_RELAXED);
+        return outcome;
+    }
+    if(use_prefix && (outcome = charge(limiter, &prefix_key, c->max_conns_prefix, c->rate_prefix, c->burst_prefix, now)) != CHARGE_OK){
+        if(use_ip){ // The address was charged already, hand its slot and token back
+            uncharge(limiter, &ip_key, 1, c->rate_ip, c->burst_ip);
+        }
+        outcome = (outcome == CHARGE_CONN) ? RL_REJECT_CONN_PREFIX : RL_REJECT_RATE_PREFIX;
+        __atomic_fetch_add(&limiter->rejected[outcome], 1, __ATOMIC_RELAXED);
+        return outcome;
+    }
+
+    hold->ip_key = ip_key;
+    hold->prefix_key = prefix_key;
+    hold->held = 1;
+    __atomic_fetch_add(&limiter->accepted, 1, __ATOMIC_RELAXED);
+    return RL_ACCEPT;
+}
+
+void rate_limit_release(rate_limiter_t *limiter, rl_hold_t *hold) {
+    const rate_limit_config_t *c = &limiter->config;
+    if(hold->held == 0){
+        return;
+    }
+    hold->held = 0;    // Clear before the fd is closed and its record can be reused by accept()
+
+    if(c->max_conns_ip > 0 || c->rate_ip > 0){
+        uncharge(limiter, &hold->ip_key, 0, c->rate_ip, c->burst_ip);
+    }
+    if(c->max_conns_prefix > 0 || c->rate_prefix > 0){
+        uncharge(limiter, &hold->prefix_key, 0, c->rate_prefix, c->burst_prefix);
+    }
+}
+
+void rate_limit_print_stats(rate_limiter_t *limiter, FILE *out) {
+    fprintf(out, "rate_limit %s=%lu", reject_names[0], __atomic_load_n(&limiter->accepted, __ATOMIC_RELAXED));
+    for(int i=RL_REJECT_CONN_IP; i<=RL_REJECT_RATE_PREFIX; i++){
+        fprintf(out, " rejected_%s=%lu", reject_names[i], __atomic_load_n(&limiter->rejected[i], __ATOMIC_RELAXED));
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+int rate_limit_free(rate_limiter_t *limiter) {
+    int return_val = 0;
+    int result;
+
+    for(int i=0; i<RL_NUM_STRIPES; i++){
+        for(int b=0; b<RL_BUCKETS_PER_STRIPE; b++){ // Free every chain in the stripe
+            rl_entry_t *entry = limiter->stripes[i].buckets[b];
+            while(entry != NULL){
+                rl_entry_t *next = entry->next;
+                free(entry);
+                entry = next;
+            }
+            limiter->stripes[i].buckets[b] = NULL;
+        }
+        if((result = pthread_mutex_destroy(&limiter->stripes[i].lock)) != 0){
+            fprintf(stderr, "pthread_mutex_destroy: %s\n", strerror(result));
+            return_val = -1;
+        }
+    }
+    return return_val;
+}
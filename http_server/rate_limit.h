@@ -0,0 +1,118 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define RL_NUM_STRIPES 16
+#define RL_BUCKETS_PER_STRIPE 256
+#define RL_ENTRY_TTL 60.0   // Seconds an idle entry is kept before it is aged out
+#define RL_IPV4_PREFIX 24
+#define RL_IPV6_PREFIX 64
+
+// Outcome of rate_limit_acquire()
+#define RL_ACCEPT 0
+#define RL_REJECT_CONN_IP 1
+#define RL_REJECT_CONN_PREFIX 2
+#define RL_REJECT_RATE_IP 3
+#define RL_REJECT_RATE_PREFIX 4
+
+// Limits applied to every client. A value of 0 disables that limit.
+typedef struct {
+    int max_conns_ip;       // Concurrent connections per client address
+    int max_conns_prefix;   // Concurrent connections per /24 (IPv4) or /64 (IPv6)
+    double rate_ip;         // Token refill rate per client address (connections/sec)
+    double burst_ip;        // Token bucket size per client address
+    double rate_prefix;     // Token refill rate per prefix (connections/sec)
+    double burst_prefix;    // Token bucket size per prefix
+} rate_limit_config_t;
+
+// Identifies either a single client address or a network prefix
+typedef struct {
+    uint8_t family;
+    uint8_t prefix_len;
+    uint8_t addr[16];   // Address with the bits past prefix_len cleared
+} rl_key_t;
+
+// Hash table entry holding the state tracked for one key
+typedef struct rl_entry {
+    rl_key_t key;
+    int active;         // Connections currently open
+    double tokens;
+    double last_refill;
+    double last_seen;
+    struct rl_entry *next;
+} rl_entry_t;
+
+// One lock-protected slice of the hash table
+typedef struct {
+    pthread_mutex_t lock;
+    rl_entry_t *buckets[RL_BUCKETS_PER_STRIPE];
+    int sweep_idx;      // Next bucket visited by the aging sweep
+} rl_stripe_t;
+
+// Keys charged for an accepted connection, kept in its conn_t until it is released
+typedef struct {
+    rl_key_t ip_key;
+    rl_key_t prefix_key;
+    int held;
+} rl_hold_t;
+
+// Struct representing a striped-lock table of per-client limits
+typedef struct {
+    rate_limit_config_t config;
+    rl_stripe_t stripes[RL_NUM_STRIPES];
+    unsigned long accepted;
+    unsigned long rejected[5];  // Indexed by the RL_REJECT_* codes
+} rate_limiter_t;
+
+/*
+ * Initialize a new rate limiter.
+ * limiter: Pointer to rate_limiter_t to be initialized
+ * config: Limits to enforce, copied into the limiter
+ * Returns 0 on success or -1 on error
+ */
+int rate_limit_init(rate_limiter_t *limiter, const rate_limit_config_t *config);
+
+/*
+ * Returns 1 if any limit in the limiter's configuration is enabled, 0 otherwise
+ */
+int rate_limit_enabled(const rate_limiter_t *limiter);
+
+/*
+ * Check a newly accepted connection against the per-address and per-prefix
+ * limits. If it is admitted, its concurrent-connection slots stay charged until
+ * rate_limit_release() is called with the same 'hold'.
+ * limiter: A pointer to the rate_limiter_t to check against
+ * hold: Set to the keys charged, if the connection is admitted
+ * addr: The peer address returned by accept()
+ * Returns RL_ACCEPT if the connection is admitted, otherwise one of the
+ * RL_REJECT_* codes naming the limit that was hit
+ */
+int rate_limit_acquire(rate_limiter_t *limiter, rl_hold_t *hold, const struct sockaddr *addr);
+
+/*
+ * Release the concurrent-connection slots charged for a connection. Does
+ * nothing if 'hold' was never filled in by rate_limit_acquire() or was
+ * released already.
+ * limiter: A pointer to the rate_limiter_t the connection was admitted by
+ * hold: The keys charged by rate_limit_acquire()
+ */
+void rate_limit_release(rate_limiter_t *limiter, rl_hold_t *hold);
+
+/*
+ * Write the accepted and rejected connection counters to a stream
+ * limiter: A pointer to the rate_limiter_t to report on
+ * out: The stream to write to
+ */
+void rate_limit_print_stats(rate_limiter_t *limiter, FILE *out);
+
+/*
+ * Deallocates and cleans up any resources associated with a rate limiter.
+ * Returns 0 on success or -1 on error
+ */
+int rate_limit_free(rate_limiter_t *limiter);
+
+#endif // RATE_LIMIT_H
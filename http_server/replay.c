@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "util.h"
+
+#define DEFAULT_WORKERS 64
+#define MAX_WORKERS 1024
+#define READ_CHUNK 16384
+#define THROTTLED_RCVBUF 65536  // Keep the kernel from absorbing a slow reader's backlog for it
+
+// One captured request and the outcome of replaying it
+typedef struct {
+    capture_record_t record;
+    char *path;
+    char *head;
+    uint64_t scheduled_ns;
+    uint64_t start_ns;
+    uint64_t first_byte_ns;
+    uint64_t done_ns;
+    int status;
+    long bytes;
+    int failed;
+} replay_req_t;
+
+static replay_req_t *reqs = NULL;
+static int n_reqs = 0;
+static struct addrinfo *target = NULL;
+static int throttle = 1;
+static int in_flight = 0;
+static int max_in_flight = 0;
+
+static int next_req = 0;    // Index of the next request a free worker claims
+
+static void sleep_until(uint64_t when_ns) {
+    struct timespec ts = {when_ns / 1000000000ull, when_ns % 1000000000ull};
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+        continue;
+    }
+}
+
+// Read a capture file into the reqs array
+// Returns 0 on success or -1 on error
+static int load_capture(const char *path) {
+    capture_file_header_t header;
+    capture_record_t record;
+    int cap = 0;
+    FILE *in = fopen(path, "rb");
+    if(in == NULL){
+        perror("fopen");
+        return -1;
+    }
+    if(fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0){
+        fprintf(stderr, "%s: not a capture file\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    while(fread(&record, sizeof(record), 1, in) == 1){
+        if(n_reqs == cap){
+            cap = cap ? cap * 2 : 1024;
+            replay_req_t *grown = realloc(reqs, cap * sizeof(replay_req_t));
+            if(grown == NULL){
+                perror("realloc");
+                fclose(in);
+                return -1;
+            }
+            reqs = grown;
+        }
+        replay_req_t *req = &reqs[n_reqs];
+        memset(req,0,sizeof(*req));
+        req->record = record;
+        req->path = calloc(1, record.path_len + 1);
+        req->head = calloc(1, record.head_len + 1);
+        if(req->path == NULL || req->head == NULL){
+            perror("calloc");
+            fclose(in);
+            return -1;
+        }
+        if(fread(req->path, 1, record.path_len, in) != record.path_len
+            || fread(req->head, 1, record.head_len, in) != record.head_len){
+            fprintf(stderr, "%s: truncated record %d, ignoring the rest\n", path, n_reqs);
+            free(req->path);
+            free(req->head);
+            break;
+        }
+        n_reqs++;
+    }
+    fclose(in);
+    return 0;
+}
+
+// qsort comparator for ascending arrival times
+static int by_arrival(const void *a, const void *b) {
+    const replay_req_t *x = a, *y = b;
+    return (x->record.arrival_ns > y->record.arrival_ns) - (x->record.arrival_ns < y->record.arrival_ns);
+}
+
+// Write the whole buffer, retrying short writes
+// Returns 0 on success or -1 on error
+static int write_all(int fd, const char *buf, size_t len) {
+    while(len > 0){
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Issue one request and read the response, at the captured read rate if throttling
+static void run_request(replay_req_t *req) {
+    char buff[READ_CHUNK];
+    char *request;
+    int request_len;
+    int fd;
+
+    req->start_ns = now_ns();
+    int now_in_flight = __atomic_add_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+    int seen = __atomic_load_n(&max_in_flight, __ATOMIC_RELAXED);
+    while(now_in_flight > seen && !__atomic_compare_exchange_n(&max_in_flight, &seen, now_in_flight, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+        continue;
+    }
+
+    size_t head_len = strlen(req->head);
+    if(head_len >= 4 && strcmp(req->head + head_len - 4, "\r\n\r\n") == 0){    // Complete capture, resend it byte for byte
+        request_len = asprintf(&request, "GET %s", req->head);
+    }
+    else{   // Headers were cut off when captured, fall back to the bare request line
+        request_len = asprintf(&request, "GET %s HTTP/1.0\r\n\r\n", req->path);
+    }
+    if(request_len == -1){
+        req->failed = 1;
+        goto done;
+    }
+
+    if((fd = socket(target->ai_family, target->ai_socktype, target->ai_protocol)) == -1){
+        perror("socket");
+        req->failed = 1;
+        free(request);
+        goto done;
+    }
+    int rcvbuf = THROTTLED_RCVBUF;
+    if(throttle && req->record.read_rate > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1){
+        perror("setsockopt");
+    }
+    if(connect(fd, target->ai_addr, target->ai_addrlen) == -1 || write_all(fd, request, request_len) == -1){
+        req->failed = 1;
+        free(request);
+        close(fd);
+        goto done;
+    }
+    free(request);
+
+    // A captured client that hung up part way is replayed hanging up at the same point
+    long limit = (req->record.flags & CAPTURE_INCOMPLETE) ? req->record.response_bytes : -1;
+    ssize_t n = 0;
+    while((limit < 0 || req->bytes < limit) && (n = read(fd, buff, (limit < 0 || limit - req->bytes > sizeof(buff)) ? sizeof(buff) : limit - req->bytes)) > 0){
+        if(req->bytes == 0){
+            req->first_byte_ns = now_ns();
+            if(n >= 12 && strncmp(buff, "HTTP/1.", 7) == 0){
+                req->status = atoi(buff + 9);
+            }
+        }
+        req->bytes += n;
+        if(throttle && req->record.read_rate > 0){  // Don't read ahead of the captured client's pace
+            sleep_until(req->first_byte_ns + (uint64_t) req->bytes * 1000000000ull / req->record.read_rate);
+        }
+    }
+    if(n == -1 || (req->bytes == 0 && limit != 0)){
+        req->failed = 1;
+    }
+    close(fd);
+
+done:
+    req->done_ns = now_ns();
+    __atomic_sub_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+}
+
+// Thread start function. Requests are claimed in arrival order by whichever worker
+// is free, which waits for the request's start time itself; when every worker is
+// busy past that time the request starts late, which shows up as lateness.
+void *replay_thread_func(void *arg) {
+    while(1){
+        int idx = __atomic_fetch_add(&next_req, 1, __ATOMIC_RELAXED);
+        if(idx >= n_reqs){
+            break;
+        }
+        sleep_until(reqs[idx].scheduled_ns);
+        run_request(&reqs[idx]);
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Print p50/p90/p99/p99.9/max of 'n' values in milliseconds, sorting them in place
+static void print_distribution(const char *label, double *ms, int n) {
+    if(n == 0){
+        printf("%-14s no samples\n", label);
+        return;
+    }
+    qsort(ms, n, sizeof(double), cmp_double);
+    printf("%-14s p50=%8.2f  p90=%8.2f  p99=%8.2f  p99.9=%8.2f  max=%8.2f ms\n", label,
+        ms[(int) (n * 0.50)], ms[(int) (n * 0.90)], ms[(int) (n * 0.99)], ms[(int) (n * 0.999)], ms[n - 1]);
+}
+
+int main(int argc, char **argv) {
+    double speed = 1.0;
+    int n_workers = DEFAULT_WORKERS;
+    int opt, result;
+
+    while((opt = getopt(argc, argv, "s:w:n")) != -1){
+        switch(opt){
+            case 's': speed = atof(optarg); break;
+            case 'w': n_workers = atoi(optarg); break;
+            case 'n': throttle = 0; break;
+            default: speed = -1; break;
+        }
+    }
+    if(argc - optind != 3 || speed <= 0 || n_workers < 1 || n_workers > MAX_WORKERS){
+        printf("Usage: %s [-s speed] [-w workers] [-n] <capture file> <host> <port>\n", argv[0]);
+        printf("  -s speed    replay N times faster than captured (default 1)\n");
+        printf("  -w workers  maximum requests in flight (default %d)\n", DEFAULT_WORKERS);
+        printf("  -n          read responses as fast as possible instead of at the captured rate\n");
+        return 1;
+    }
+
+    if(load_capture(argv[optind]) == -1){
+        return 1;
+    }
+    if(n_reqs == 0){
+        printf("Capture is empty\n");
+        return 0;
+    }
+    qsort(reqs, n_reqs, sizeof(replay_req_t), by_arrival);
+
+    struct addrinfo hints;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int retval = getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &target);
+    if(retval != 0){
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(retval));
+        return 1;
+    }
+
+    pthread_t *threads = calloc(n_workers, sizeof(pthread_t));
+    if(threads == NULL){
+        fprintf(stderr, "Failed to initialize workers\n");
+        return 1;
+    }
+
+    // Issue every request at its captured arrival time, scaled by the speed factor
+    uint64_t first_arrival = reqs[0].record.arrival_ns;
+    uint64_t replay_start = now_ns() + 1000000;  // A millisecond for the workers to start up
+    for(int i=0; i<n_reqs; i++){
+        reqs[i].scheduled_ns = replay_start + (uint64_t) ((reqs[i].record.arrival_ns - first_arrival) / speed);
+    }
+    for(int i=0; i<n_workers; i++){
+        if((result = pthread_create(threads + i, NULL, replay_thread_func, NULL)) != 0){
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            return 1;
+        }
+    }
+    for(int i=0; i<n_workers; i++){ // Each worker returns once no request is left to claim
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t replay_end = now_ns();
+
+    double *ttfb = malloc(n_reqs * sizeof(double));
+    double *total = malloc(n_reqs * sizeof(double));
+    double *late = malloc(n_reqs * sizeof(double));
+    double *captured = malloc(n_reqs * sizeof(double));
+    int n_ok = 0, n_failed = 0, n_mismatch = 0, n_ttfb = 0, n_started = 0;
+    long bytes = 0;
+    if(ttfb == NULL || total == NULL || late == NULL || captured == NULL){
+        perror("malloc");
+        return 1;
+    }
+    for(int i=0; i<n_reqs; i++){
+        replay_req_t *req = &reqs[i];
+        captured[i] = req->record.service_ns / 1e6;
+        if(req->start_ns == 0){ // Never issued
+            n_failed++;
+            continue;
+        }
+        late[n_started++] = (req->start_ns - req->scheduled_ns) / 1e6;
+        if(req->failed){
+            n_failed++;
+            continue;
+        }
+        if(req->record.status != 0 && req->status != req->record.status){
+            n_mismatch++;
+        }
+        if(req->bytes > 0){
+            ttfb[n_ttfb++] = (req->first_byte_ns - req->start_ns) / 1e6;
+        }
+        total[n_ok] = (req->done_ns - req->start_ns) / 1e6;
+        bytes += req->bytes;
+        n_ok++;
+    }
+
+    double seconds = (replay_end - replay_start) / 1e9;
+    printf("Replayed %d requests in %.2f s at %.2fx (%.1f req/s, %.1f MB/s)\n", n_reqs, seconds, speed, n_reqs / seconds, bytes / 1e6 / seconds);
+    printf("ok=%d failed=%d status_mismatch=%d max_in_flight=%d read_rate=%s\n", n_ok, n_failed, n_mismatch, max_in_flight, throttle ? "captured" : "unthrottled");
+    print_distribution("first byte", ttfb, n_ttfb);
+    print_distribution("total", total, n_ok);
+    print_distribution("start lateness", late, n_started);
+    print_distribution("captured svc", captured, n_reqs);
+
+    for(int i=0; i<n_reqs; i++){
+        free(reqs[i].path);
+        free(reqs[i].head);
+    }
+    free(reqs);
+    free(threads);
+    free(ttfb);
+    free(total);
+    free(late);
+    free(captured);
+    freeaddrinfo(target);
+    return (n_failed > 0) ? 1 : 0;
+}
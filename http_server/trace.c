@@ -0,0 +1,3 @@
+#include "trace.h"
+
+__thread uint64_t trace_conn_id = 0;
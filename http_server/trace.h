@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * USDT probes on the request lifecycle, provider "http_server". Each probe
+ * carries the connection id handed out at accept time as its first argument.
+ * With <sys/sdt.h> available a probe is a single nop until a tracer attaches;
+ * without it the probes compile away. List them with:
+ *   bpftrace -l 'usdt:./http_server:*'
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef TRACE_HAVE_SDT
+#define TRACE_ACCEPT(id, fd) DTRACE_PROBE2(http_server, accept, id, fd)
+#define TRACE_ENQUEUE(id, fd) DTRACE_PROBE2(http_server, enqueue, id, fd)
+#define TRACE_DEQUEUE(id, fd) DTRACE_PROBE2(http_server, dequeue, id, fd)
+#define TRACE_REQUEST_PARSED(id, path) DTRACE_PROBE2(http_server, request_parsed, id, path)
+#define TRACE_FILE_OPEN(id, path, file_fd) DTRACE_PROBE3(http_server, file_open, id, path, file_fd)
+#define TRACE_FIRST_BYTE(id) DTRACE_PROBE1(http_server, first_byte, id)
+#define TRACE_RESPONSE_COMPLETE(id, status, bytes) DTRACE_PROBE3(http_server, response_complete, id, status, bytes)
+#define TRACE_CLOSE(id, fd) DTRACE_PROBE2(http_server, close, id, fd)
+#else
+#define TRACE_ACCEPT(id, fd) do { (void) (id); (void) (fd); } while (0)
+#define TRACE_ENQUEUE(id, fd) do { (void) (id); (void) (fd); } while (0)
+#define TRACE_DEQUEUE(id, fd) do { (void) (id); (void) (fd); } while (0)
+#define TRACE_REQUEST_PARSED(id, path) do { (void) (id); (void) (path); } while (0)
+#define TRACE_FILE_OPEN(id, path, file_fd) do { (void) (id); (void) (path); (void) (file_fd); } while (0)
+#define TRACE_FIRST_BYTE(id) do { (void) (id); } while (0)
+#define TRACE_RESPONSE_COMPLETE(id, status, bytes) do { (void) (id); (void) (status); (void) (bytes); } while (0)
+#define TRACE_CLOSE(id, fd) do { (void) (id); (void) (fd); } while (0)
+#endif
+
+// Id of the connection the calling worker thread is currently serving, from its conn_t
+extern __thread uint64_t trace_conn_id;
+
+#endif // TRACE_H
@@ -0,0 +1,23 @@
+#include <time.h>
+#include "util.h"
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for(size_t i=0; i<len; i++){
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,25 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FNV1A_INIT 14695981039346656037ull
+
+/*
+ * Continue a 64-bit FNV-1a hash over 'len' more bytes. Start from FNV1A_INIT;
+ * hashing data in pieces gives the same result as hashing it whole.
+ */
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len);
+
+/*
+ * Return CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t now_ns(void);
+
+/*
+ * Return CLOCK_MONOTONIC in seconds
+ */
+double now_seconds(void);
+
+#endif // UTIL_H